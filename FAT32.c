@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // for FNM_CASEFOLD
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -7,9 +8,16 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-//#include <unistd.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <locale.h>
 #include <wchar.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <regex.h>
 
 #pragma pack(1)
 
@@ -94,7 +102,7 @@ typedef union {
 	unsigned short DIR_WrtTime;	      // time of last write
 	unsigned short DIR_WrtDate;       // date of last write
 	unsigned short DIR_FstClusLO;     // LOW WORD of this entry's cluster number
-	unsigned long  DIR_FileSize;	  // 32-bit DWORD holding this file's size in BYTES
+	unsigned int   DIR_FileSize;	  // 32-bit DWORD holding this file's size in BYTES
     };
     unsigned char directoryEntry[32];
     struct {
@@ -111,6 +119,224 @@ typedef union {
     };
 } DIR;
 
+// One file or directory found while walking the directory tree
+typedef struct DirItem{
+    DIR           entry;          // the 8.3 entry itself
+    DIR           lfnEntries[20]; // raw LFN entries in disk order, only decoded when needed
+    int           numLFN;         // number of LFN entries that belong to this entry
+    const char    *dirPath;       // path of the directory holding this entry ("" for root)
+} DirItem;
+
+// Room for the longest long name: 255 UCS-2 characters of up to 3 UTF-8 bytes each, plus '\0'
+#define MAX_NAME_BYTES 766
+
+// A directory holds at most 65536 entries, longer chains are damaged or loop. Trees are not
+// walked deeper than WALK_MAX_DEPTH, and never into a directory that is being walked already
+#define DIR_MAX_ENTRIES 65536
+#define WALK_MAX_DEPTH  128
+
+// Called for every entry walkDir finds, return false to stop the walk
+typedef bool (*WalkCallback)(DirItem *item, void *context);
+
+// Filters for the FIND command, cheap checks on the 32-byte entry are done before names
+typedef struct FindFilter{
+    char           *pattern;      // glob matched against the 8.3 and long name (NULL = any)
+    bool           useRegex;      // match names against regex instead of pattern
+    regex_t        regex;
+    unsigned long  minSize;       // size range in bytes
+    unsigned long  maxSize;
+    unsigned char  attrMask;      // every bit set here must be set in DIR_Attr
+    unsigned short crtFrom;       // creation date range in packed FAT date format
+    unsigned short crtTo;
+    unsigned short wrtFrom;       // last write date range in packed FAT date format
+    unsigned short wrtTo;
+    int            numMatches;
+} FindFilter;
+
+// Growable byte array used to batch output before it is written
+typedef struct ByteBuffer{
+    unsigned char *data;
+    size_t        used;
+    size_t        size;
+    bool          failed;          // an append was dropped because memory ran out
+} ByteBuffer;
+
+// Output formats for the EXPORT command
+#define EXPORT_CSV   0
+#define EXPORT_JSONL 1
+#define EXPORT_BIN   2
+
+#define EXPORT_BATCH_BYTES (1 << 20) // csv/jsonl rows are written in batches of about 1 MB
+#define EXPORT_BATCH_ROWS  65536     // rows per batch in the binary column format
+
+// Columns of the binary format, every batch is the row count followed by each column
+// as a 32-bit byte length and the data. _END columns hold the 32-bit end offset of each
+// row's string in the column after them. Numbers are in host byte order, dates and times
+// are the raw FAT fields
+enum { COL_SIZE, COL_CLUSTER, COL_ATTR, COL_CRT_DATE, COL_CRT_TIME, COL_CRT_TENTH,
+       COL_WRT_DATE, COL_WRT_TIME, COL_ACC_DATE, COL_PATH_END, COL_PATH,
+       COL_SHORT_END, COL_SHORT, COL_LONG_END, COL_LONG, NUM_COLUMNS };
+
+// State threaded through walkDir by the EXPORT command
+typedef struct ExportState{
+    FILE          *out;
+    int           format;
+    ByteBuffer    rows;                  // csv/jsonl text waiting to be written
+    ByteBuffer    columns[NUM_COLUMNS];  // binary columns of the current batch
+    unsigned int  batchRows;
+    unsigned long numRows;
+    bool          failed;                // a write to out failed, the walk stops
+} ExportState;
+
+// State for looking up one path component with lookupCallback
+typedef struct LookupState{
+    const char    *name;
+    DirItem       *found;
+    bool          matched;
+} LookupState;
+
+// One file or directory going into a tar archive or extracted by EXTRACTALL
+typedef struct TarItem{
+    char           *path;         // name inside the archive
+    unsigned long  cluster;       // first cluster, files are written in this order
+    unsigned long  size;
+    unsigned short date;          // last write date and time
+    unsigned short time;
+    bool           isDir;
+    int            order;         // position in the walk, keeps directories in tree order
+} TarItem;
+
+// State threaded through walkDir by the TAR and EXTRACTALL commands
+typedef struct TarState{
+    FindFilter    filter;
+    bool          useFilter;      // only files passing filter are archived, without directories
+    TarItem       *items;
+    int           numItems;
+    int           maxItems;
+} TarState;
+
+#define DATA_RUN_BYTES (1 << 20)   // largest single read when copying file data
+
+// One run of clusters that are next to each other on disk, going to offset destOffset of dest
+typedef struct IORead{
+    unsigned long  lba;            // first sector on the image
+    unsigned long  sectors;
+    FILE           *dest;
+    unsigned long  destOffset;
+    unsigned long  length;         // bytes to copy, the last run of a file can be short
+    bool           failed;         // set by runPlan when the data could not be read or written
+} IORead;
+
+// Reads gathered for a batch of files, runPlan does them in LBA order
+typedef struct IOPlan{
+    IORead         *reads;
+    int            numReads;
+    int            maxReads;
+    unsigned long  gapSectors;     // holes of up to this many sectors are read through
+    int            numMerged;      // freads done by the last runPlan
+} IOPlan;
+
+#define PLAN_MAX_READ  (8 << 20)   // largest merged read
+#define PLAN_MAX_FILES 256         // files open at once while extracting a batch
+#define PLAN_GAP       8           // default gap tolerance in clusters
+
+// One directory cluster kept in memory, the cache is direct mapped on the cluster number
+typedef struct DirCacheSlot{
+    unsigned long  cluster;        // 0 when the slot is empty
+    unsigned char  *data;
+} DirCacheSlot;
+
+#define DIR_CACHE_SLOTS 256
+
+// Everything known about one open image. The server keeps one per image and swaps them
+// in and out of the globals below with useVolume and saveVolume
+typedef struct Volume{
+    char           *path;
+    FILE           *fileptr;
+    unsigned int   fatLBA;
+    unsigned long  sectorsPerCluster;
+    unsigned long  reservedSectors;
+    unsigned long  sectorsPerFAT;
+    unsigned long  dataSectorStart;
+    MBR            mbr;
+    BPB            bpb;
+    unsigned int   *fatTable;
+    unsigned long  numFATEntries;
+    DirCacheSlot   *dirCache;
+} Volume;
+
+// One connection to the server, the request line it is sending and the response waiting
+// to be sent, a client only gets its next request answered once the last response is out
+typedef struct Client{
+    int            fd;
+    char           line[1024];
+    size_t         used;
+    ByteBuffer     pending;
+    size_t         sent;           // bytes of pending already written to the socket
+    bool           closing;        // close once pending is sent
+} Client;
+
+#define SERVE_MAX_CLIENTS 64
+#define SERVE_MAX_READ    (64 << 20) // largest READ answered in one response
+
+// One file or directory recorded in a snapshot
+typedef struct SnapEntry{
+    char           *name;          // long name, or 8.3 name if there is none
+    char           *path;
+    unsigned long  cluster;
+    unsigned int   size;
+    unsigned short wrtDate;
+    unsigned short wrtTime;
+    unsigned char  attr;
+    unsigned long long chainHash;  // hash of the cluster numbers of a file's chain, see hashChain
+} SnapEntry;
+
+// One directory recorded in a snapshot, its entries are entries[firstEntry] onwards
+typedef struct SnapDir{
+    unsigned long      cluster;
+    unsigned long long hash;       // hash of every cluster of the directory
+    int                firstEntry;
+    int                numEntries;
+} SnapDir;
+
+// Hashes of the FAT and the directories of an image, used by SNAPSHOT and DIFF
+typedef struct Snapshot{
+    unsigned long      numBlocks;
+    unsigned long long *blockHashes; // one per FAT_HASH_ENTRIES FAT entries
+    bool               *changedBlocks; // blocks that differ from the old snapshot, if there was one
+    SnapDir            *dirs;
+    int                numDirs;
+    int                maxDirs;
+    SnapEntry          *entries;
+    int                numEntries;
+    int                maxEntries;
+    int                numDecoded;   // directories that had to be decoded to build it
+} Snapshot;
+
+// State threaded through walkDir while decoding one directory for a snapshot
+typedef struct SnapBuild{
+    Snapshot       *snap;
+    const char     *path;
+} SnapBuild;
+
+#define FAT_HASH_ENTRIES 1024 // FAT entries (4 KB) per hashed block
+#define FNV_OFFSET       0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+// Running totals for the STORE command
+typedef struct StoreStats{
+    unsigned long  numFiles;
+    unsigned long  numChunks;
+    unsigned long  newChunks;
+    unsigned long  newBytes;       // written to the store
+    unsigned long  skippedBytes;   // already in the store
+} StoreStats;
+
+// Files are cut into chunks of this size from their start. It is a whole number of clusters
+// for every cluster size up to 64 KB, so chunks line up with clusters and the same data gets
+// the same chunks on images with different cluster sizes
+#define STORE_CHUNK_BYTES (64 << 10)
+
 // Variables
 FILE          *fileptr;      // The image we will read in 
 unsigned int  fatLBA;        // Start of the FAT32 File System, represents the offset we need to use
@@ -125,6 +351,11 @@ unsigned long dirEntriesPerSector;
 unsigned long dataSectorStart; // start of cluster 2, the first sector of the root directory
 
 int*          FATEntries;
+unsigned int  *fatTable;       // the whole first FAT, loaded by loadFAT the first time it is needed
+unsigned long numFATEntries;
+DirCacheSlot  *dirCache;       // directory clusters read by walkDir, see readDirCluster
+unsigned long walkStack[WALK_MAX_DEPTH]; // first clusters of the directories being walked
+int           walkDepth;
 unsigned char *buffer;
 unsigned char sectorBuffer[512];
 unsigned char entryBuffer[4];
@@ -135,6 +366,7 @@ DIR dirEntry;
 
 int numFiles;
 unsigned long totalFileSize;
+bool commandFailed;            // the last command could not finish, the exit status when run from argv
 
 // Functions
 void printBytes(void* arr, int n);
@@ -143,6 +375,7 @@ void displaySector(unsigned char* sector);
 void          readEntry(unsigned long sectorNum, unsigned long entryNum, unsigned char *buffer);
 void          readRootDir(unsigned long cluster);
 unsigned long readFAT(unsigned long cluster);
+bool          loadFAT();
 
 unsigned long getNextCluster(DIR dirEntry);
 unsigned long getFirstSector(unsigned long cluster);
@@ -154,210 +387,488 @@ unsigned char ChkSum(unsigned char *pFcbName);
 void          copyFile(unsigned long cluster, FILE *fp);
 void          readFile(unsigned long cluster, char *fileName);
 
+bool          walkDir(unsigned long cluster, const char *path, WalkCallback callback, void *context,
+					      bool recursive);
+bool          enterDir(unsigned long cluster);
+void          leaveDir(void);
+bool          dirOnStack(unsigned long cluster);
+bool          clusterSeen(unsigned long *chain, unsigned long length, unsigned long cluster);
+bool          lookupPath(const char *path, DirItem *found);
+bool          lookupCallback(DirItem *item, void *context);
+void          getShortName(DIR *entry, char name[13]);
+void          getLongName(DirItem *item, char name[], size_t size);
+void          getSafeName(DirItem *item, char name[], size_t size);
+void          getItemPath(DirItem *item, char path[]);
+char*         nextToken(char **cursor);
+
+bool          parseDate(const char *text, unsigned short *date);
+bool          parseDateRange(char *text, unsigned short *from, unsigned short *to);
+bool          parseSize(const char *text, unsigned long *size);
+bool          parseSizeRange(char *text, unsigned long *min, unsigned long *max);
+bool          parseAttr(const char *text, unsigned char *mask);
+bool          parseFilter(char *args, FindFilter *filter);
+void          freeFilter(FindFilter *filter);
+bool          matchName(const char *name, FindFilter *filter);
+bool          matchFilter(DirItem *item, FindFilter *filter);
+bool          findCallback(DirItem *item, void *context);
+
+void          decodeDate(unsigned short date, int *year, int *month, int *day);
+void          decodeTime(unsigned short time, int *hour, int *minute, int *second);
+
+void          appendBytes(ByteBuffer *buf, const void *data, size_t n);
+void          appendNumber(ByteBuffer *buf, unsigned long number, int width);
+void          appendTimestamp(ByteBuffer *buf, unsigned short date, unsigned short time,
+					          int tenth, bool hasTime);
+void          appendEscaped(ByteBuffer *buf, const char *text, int format);
+void          appendFieldName(ExportState *state, const char *name, bool first);
+void          appendTimeField(ExportState *state, const char *name, unsigned short date,
+					          unsigned short time, int tenth, bool hasTime);
+bool          exportMetadata(char *formatName, char *outName);
+bool          exportCallback(DirItem *item, void *context);
+void          flushExport(ExportState *state);
+
+unsigned long writeFileData(unsigned long cluster, unsigned long size, FILE *out);
+time_t        fatToUnixTime(unsigned short date, unsigned short time);
+void          writeTarHeader(FILE *out, const char *name, unsigned long size, time_t mtime,
+					         char type);
+bool          tarCallback(DirItem *item, void *context);
+int           compareTarItems(const void *a, const void *b);
+bool          writeTar(char *outName, char *dirPath, char *filterArgs);
+
+void          planFile(IOPlan *plan, unsigned long cluster, unsigned long size, FILE *dest);
+int           compareIOReads(const void *a, const void *b);
+void          runPlan(IOPlan *plan);
+bool          makeDirs(char *path);
+FILE*         createFile(const char *path);
+bool          extractAll(char *outDir, unsigned long gapClusters, char *filterArgs);
+
+bool          openImage(const char *path);
+bool          readDirCluster(unsigned long cluster, unsigned char *data);
+void          useVolume(Volume *volume);
+void          saveVolume(Volume *volume);
+
+unsigned long readFileRange(unsigned long cluster, unsigned long size, unsigned long offset,
+					        unsigned long length, ByteBuffer *out);
+void          appendEntryLine(ByteBuffer *out, DIR *entry, const char *name);
+bool          listCallback(DirItem *item, void *context);
+void          serveRequest(char *request, Volume *volumes, int numVolumes, const char *extractDir,
+					       ByteBuffer *response);
+bool          serveClient(Client *client, Volume *volumes, int numVolumes, const char *extractDir);
+bool          serve(const char *socketPath, const char *extractDir, char *imagePaths[], int numImages);
+
+unsigned long long hashBytes(const unsigned char *data, size_t n, unsigned long long hash);
+unsigned long long hashDir(unsigned long cluster);
+unsigned long long hashChain(unsigned long cluster);
+SnapEntry*    addSnapEntry(Snapshot *snap, const char *name, const char *path);
+bool          snapCallback(DirItem *item, void *context);
+int           compareSnapDirs(const void *a, const void *b);
+int           compareSnapPaths(const void *a, const void *b);
+int           compareSnapClusters(const void *a, const void *b);
+void          snapshotDir(Snapshot *snap, Snapshot *old, unsigned long cluster, const char *path);
+void          buildSnapshot(Snapshot *snap, Snapshot *old);
+void          freeSnapshot(Snapshot *snap);
+bool          saveSnapshot(Snapshot *snap, const char *fileName);
+bool          loadSnapshot(Snapshot *snap, FILE *in);
+bool          chainChanged(unsigned long cluster, bool *changedBlocks, unsigned long numBlocks);
+bool          chainsDiffer(unsigned long cluster, unsigned int *otherFAT, unsigned long otherEntries);
+bool          diffImage(char *otherName);
+
+void          sha256Block(unsigned int state[8], const unsigned char block[64]);
+void          sha256(const unsigned char *data, size_t n, unsigned char digest[32]);
+bool          storeChunk(const char *storeDir, const unsigned char *data, size_t n,
+					     char hex[65], StoreStats *stats);
+bool          storeFile(const char *storeDir, FILE *manifest, unsigned long cluster,
+					    unsigned long size, unsigned char *chunk, StoreStats *stats);
+bool          storeAll(char *storeDir, char *manifestDir, char *filterArgs);
+
+bool          runCommand(char *command);
+
 int main( int argc, char *argv[] ){
     // allocate 32 bytes to buffer, used for reading 32 byte entries
     buffer = malloc(32);
 
+    // set the locale once so sizes print with thousands separators
+    setlocale(LC_ALL, "");
+
     // if statements to confirm proper command line arguments
-    if( argc == 2 ){
+    if( argc >= 4 && strcmp(argv[1], "--serve") == 0 ){
+		// ./FAT32 --serve <socket> [--extract-dir <dir>] <image> [image ...] answers requests
+		// until killed, EXTRACT requests are only allowed with an extract directory
+		if(argc >= 6 && strcmp(argv[3], "--extract-dir") == 0){
+		    return serve(argv[2], argv[4], argv + 5, argc - 5) ? 0 : 1;
+		}
+		return serve(argv[2], NULL, argv + 3, argc - 3) ? 0 : 1;
+    }
+    else if( argc >= 2 ){
 		// Here we will read the image of a FAT32 drive
 		// USE UNSIGNED FOR MOST DATATYPES 
-		printf("The drive image supplied is %s\n", argv[1]);
-
-		fileptr = fopen(argv[1], "rb"); // open the file in read binary mode
-		fseek(fileptr, 0, SEEK_SET);    // make sure we are at the start of the file
-
-		// read 512 bytes, 1 at a time, FROM fileptr current position INTO sectorBuffer
-		fread(sectorBuffer, 512, 1, fileptr);
-
-		// get master boot record sector and display it
-		mbr = *(MBR*)sectorBuffer;
-
-		// displaySector((unsigned char*) &mbr);
-		/*
-		printf("First Sector of FAT Partition: %02X %02X %02X %02X\n",										 mbr.part1.LBABegin[0], 									     mbr.part1.LBABegin[1],										 mbr.part1.LBABegin[2],
-					     mbr.part1.LBABegin[3]);
- 
-		printf("FAT Sector Number: %d\n", mbr.part1.LBABegin[0]);
-		*/
-
-		// Assign start of FAT LBA to global variable
-		fatLBA = (unsigned int)mbr.part1.LBABegin[0]; 
-
-		fseek(fileptr, 0, SEEK_SET);            // Reset the cursor to start of image
-		fseek(fileptr, fatLBA * 512, SEEK_SET); // Set cursor to start of FAT32 partition
-		fread(sectorBuffer, 512, 1, fileptr);   // Read first sector of FAT32 - BPB
-
-		bpb = *(BPB*)sectorBuffer;	        // BIOS-Parameter block struct creation
+		if(argc == 2){
+		    printf("The drive image supplied is %s\n", argv[1]);
+		}
 
-		// printf("Size of BPB is %i\n", sizeof(bpb));
-		// displaySector((unsigned char*) &bpb);
+		if(!openImage(argv[1])){
+		    return 1;
+		}
 
-	// Get BPB info
-		sectorsPerFAT = bpb.BPB_FATSz32;
-		// printf("Number of sectors in ONE copy of the FAT: %lu\n", sectorsPerFAT);
+		// Below are the variable declarations to deal with the commands we support
+		bool quit   = false;
+		char command[256] = {'\0'};
 
-		sectorsPerCluster = bpb.BPB_SecPerClus;
-		// printf("Sectors Per Cluster: %lu\n", sectorsPerCluster);
-		// printf("Clusters in one copy of the FAT: %lu\n", sectorsPerFAT / sectorsPerCluster);
+		// any arguments after the image are run as a single command without the prompt,
+		// e.g. ./FAT32 Drive.img TAR - /  to write a tar stream to stdout
+		if(argc > 2){
+		    int  arg;
+		    // EXTRACT takes the rest of the line as the file name, so only quote
+		    // arguments with spaces again for the commands parsed with nextToken
+		    bool restOfLine = strcmp(argv[2], "EXTRACT") == 0;
+		    for(arg = 2; arg < argc; arg++){
+				bool quote = !restOfLine && strchr(argv[arg], ' ') != NULL;
+				snprintf(command + strlen(command), sizeof(command) - strlen(command),
+					     quote ? "%s\"%s\"" : "%s%s", arg > 2 ? " " : "", argv[arg]);
+		    }
+		    commandFailed = false;
+		    runCommand(command);
+		    quit = true;
+		}
 
-		reservedSectors = bpb.BPB_RsvdSecCnt;
-		// printf("Start of FAT is at sector: %lu\n", fatLBA + reservedSectors);
+		while(!quit){
+	    	printf("\nPlease enter a command:\n");
+		    printf(">");
+		    // get input here, stop at end of input
+		    if(fgets(command, 256, stdin) == NULL){
+				break;
+		    }
+		    // drop the newline so it is not part of file names and patterns
+		    command[strcspn(command, "\r\n")] = '\0';
+
+		    quit = runCommand(command);
+		}
+    }
+    else{
+		printf("One argument expected.\n");
+    }
 
-		dataSectorStart = bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * bpb.BPB_FATSz32);
+    if(fileptr != NULL){
+		fclose(fileptr); 				 // Close the file
+    }
 
-	// Go to the start of the FAT and display the first sector
-		fseek(fileptr, 0, SEEK_SET);
-		fseek(fileptr, (fatLBA + reservedSectors) * 512, SEEK_SET);
-		fread(sectorBuffer, 512, 1, fileptr);
+    // a command given on the command line sets the exit status
+    return argc > 2 && commandFailed ? 1 : 0;
+}
 
-		// printf("First Sector of the FAT\n");
-		// displaySector(sectorBuffer);
+// Open the image at path and read the MBR and BPB into the globals
+bool openImage(const char *path){
+    fatTable      = NULL;
+    numFATEntries = 0;
+    dirCache      = NULL;
 
-	// READ IN FAT -- first sector
-		FATEntries = (int*)sectorBuffer;
+	fileptr = fopen(path, "rb"); // open the file in read binary mode
+	if(fileptr == NULL){
+	    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	    return false;
+	}
+	fseek(fileptr, 0, SEEK_SET);    // make sure we are at the start of the file
 
-	/*  Below is code that was used for testing purposes only	
-		// READ in the first 32 bytes of the root directory to show next root directory cluster	
-		fseek(fileptr, 0, SEEK_SET);
-		fseek(fileptr, ((fatLBA + reservedSectors) * 512) + bpb.BPB_RootClus * 4, SEEK_SET);	
-		fread(buffer, 32, 1, fileptr);
+	// read 512 bytes, 1 at a time, FROM fileptr current position INTO sectorBuffer
+	fread(sectorBuffer, 512, 1, fileptr);
 
-		// printf("First Cluster of the root directory (cluster 2): %08X\n", bpb.BPB_RootClus);
-		// printf("Clusters dont start until the FAT\n");
-		// printf("\nWe know that the next CLUSTER of the root directory is at FAT[2]: ");
-		// printBytes(buffer, 4 * sizeof(unsigned char));
+	// get master boot record sector and display it
+	mbr = *(MBR*)sectorBuffer;
 
-		// printf("FAT [2]: %d\n", FATEntries[2]);	
-		// FAT[5669] is in sector (5669 / 128) = 44
+	// displaySector((unsigned char*) &mbr);
+	/*
+	printf("First Sector of FAT Partition: %02X %02X %02X %02X\n",										 mbr.part1.LBABegin[0], 									     mbr.part1.LBABegin[1],										 mbr.part1.LBABegin[2],
+				     mbr.part1.LBABegin[3]);
+ 
+	printf("FAT Sector Number: %d\n", mbr.part1.LBABegin[0]);
+	*/
 
-		fseek(fileptr, 0, SEEK_SET);
-		fseek(fileptr, ((fatLBA + reservedSectors + (FATEntries[bpb.BPB_RootClus] / 128)) * 512),
-		         		SEEK_SET);	
-		fread(sectorBuffer, 512, 1, fileptr);
-		displaySector(sectorBuffer);
-		FATEntries = (int*)sectorBuffer;
+	// Assign start of FAT LBA to global variable, all 4 bytes (little-endian) so partitions
+	// starting past sector 255 (usually 2048 on SD cards) work
+	fatLBA = (unsigned int)mbr.part1.LBABegin[0]        | (unsigned int)mbr.part1.LBABegin[1] << 8 |
+	         (unsigned int)mbr.part1.LBABegin[2] << 16  | (unsigned int)mbr.part1.LBABegin[3] << 24; 
+
+	fseek(fileptr, 0, SEEK_SET);            // Reset the cursor to start of image
+	fseek(fileptr, (unsigned long)fatLBA * 512, SEEK_SET); // Set cursor to start of FAT32 partition
+	fread(sectorBuffer, 512, 1, fileptr);   // Read first sector of FAT32 - BPB
+
+	bpb = *(BPB*)sectorBuffer;	        // BIOS-Parameter block struct creation
+
+	// make sure this looks like a FAT32 volume before using any of the numbers in it
+	if(bpb.signature[0] != 0x55 || bpb.signature[1] != 0xAA || bpb.BPB_BytsPerSec != 512 ||
+	   bpb.BPB_SecPerClus == 0 || bpb.BPB_FATSz32 == 0){
+	    fprintf(stderr, "%s is not a FAT32 image\n", path);
+	    fclose(fileptr);
+	    fileptr = NULL;
+	    return false;
+	}
+
+	// printf("Size of BPB is %i\n", sizeof(bpb));
+	// displaySector((unsigned char*) &bpb);
+
+// Get BPB info
+	sectorsPerFAT = bpb.BPB_FATSz32;
+	// printf("Number of sectors in ONE copy of the FAT: %lu\n", sectorsPerFAT);
+
+	sectorsPerCluster = bpb.BPB_SecPerClus;
+	// printf("Sectors Per Cluster: %lu\n", sectorsPerCluster);
+	// printf("Clusters in one copy of the FAT: %lu\n", sectorsPerFAT / sectorsPerCluster);
+
+	reservedSectors = bpb.BPB_RsvdSecCnt;
+	// printf("Start of FAT is at sector: %lu\n", fatLBA + reservedSectors);
+
+	dataSectorStart = bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * bpb.BPB_FATSz32);
+
+// Go to the start of the FAT and display the first sector
+	fseek(fileptr, 0, SEEK_SET);
+	fseek(fileptr, (fatLBA + reservedSectors) * 512, SEEK_SET);
+	fread(sectorBuffer, 512, 1, fileptr);
+
+	// printf("First Sector of the FAT\n");
+	// displaySector(sectorBuffer);
+
+// READ IN FAT -- first sector
+	FATEntries = (int*)sectorBuffer;
+
+/*  Below is code that was used for testing purposes only	
+	// READ in the first 32 bytes of the root directory to show next root directory cluster	
+	fseek(fileptr, 0, SEEK_SET);
+	fseek(fileptr, ((fatLBA + reservedSectors) * 512) + bpb.BPB_RootClus * 4, SEEK_SET);	
+	fread(buffer, 32, 1, fileptr);
+
+	// printf("First Cluster of the root directory (cluster 2): %08X\n", bpb.BPB_RootClus);
+	// printf("Clusters dont start until the FAT\n");
+	// printf("\nWe know that the next CLUSTER of the root directory is at FAT[2]: ");
+	// printBytes(buffer, 4 * sizeof(unsigned char));
+
+	// printf("FAT [2]: %d\n", FATEntries[2]);	
+	// FAT[5669] is in sector (5669 / 128) = 44
+
+	fseek(fileptr, 0, SEEK_SET);
+	fseek(fileptr, ((fatLBA + reservedSectors + (FATEntries[bpb.BPB_RootClus] / 128)) * 512),
+	         		SEEK_SET);	
+	fread(sectorBuffer, 512, 1, fileptr);
+	displaySector(sectorBuffer);
+	FATEntries = (int*)sectorBuffer;
+
+	printf("FAT [5669]: %08X\n", FATEntries[5669 % 128]);
+	printf("\n");
+
+	// The location of the first cluster of the root directory from fat32 documentation
+	dataSectorStart = bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * bpb.BPB_FATSz32);
+
+	// output a directory entry not a sector (32 bytes vs 512)	
+	// printf("The first 32 byte entry in the root directory:\n");
+
+	fseek(fileptr, 0, SEEK_SET);
+	fseek(fileptr, (dataSectorStart + fatLBA) * 512, SEEK_SET);
+	fread(buffer, 32, 1, fileptr);
+	// printBytes(buffer, 32 * sizeof(unsigned char));
+
+	fseek(fileptr, 0, SEEK_SET);
+	fseek(fileptr, (dataSectorStart + fatLBA) * 512, SEEK_SET);
+	fread(sectorBuffer, 512, 1, fileptr);
+	displaySector(sectorBuffer);
+	printf("This is the data in the first sector of cluster 2 (the root directory)\n");
+*/
 
-		printf("FAT [5669]: %08X\n", FATEntries[5669 % 128]);
-		printf("\n");
+    return true;
+}
 
-		// The location of the first cluster of the root directory from fat32 documentation
-		dataSectorStart = bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * bpb.BPB_FATSz32);
+// Run one command, returns true once the user asks to quit
+bool runCommand(char *command){
+    char cmd1[] = "DIR";
+    char cmd2[] = "EXTRACT";
+    char cmd3[] = "QUIT";
+    char cmd4[] = "FIND";
+    char cmd5[] = "EXPORT";
+    char cmd6[] = "TAR";
+    char cmd7[] = "EXTRACTALL";
+    char cmd8[] = "SNAPSHOT";
+    char cmd9[] = "DIFF";
+    char cmd10[] = "STORE";
+
+    	// here we will support the DIR command, will list all files in the current(root) dir
+    	if(strncmp(command, cmd1, 3) == 0){
+			// check for files? -- need to write a function to check
+			bool isFiles = true;
+			// sector after FAT (both copies) -- where the data sector starts
+			dataSectorStart = bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * bpb.BPB_FATSz32);
+
+			if(isFiles){
+	    		printf("Files:\n");	
+
+	    		// read the directory for files
+	    		readRootDir(bpb.BPB_RootClus);
+	    		// Print a summary of the files from the root directory
+    		   		printf("\nSummary: Number of Files: %d Size of Files: %'ld\n", 
+					     numFiles, totalFileSize);
+			}
+			else{
+	    		printf("File not found\n");
+			}
+    	}
+    	// here we support the EXTRACTALL command, checked before EXTRACT which is a prefix of it
+		// EXTRACTALL will be followed by the output directory, an optional gap and filters
+    	else if(strncmp(command, cmd7, 10) == 0){
+			char          *args       = command + 10;
+			char          *outDir     = nextToken(&args);
+			char          *value;
+			unsigned long gapClusters = PLAN_GAP;
+
+			// the gap option comes before the FIND pattern and filters
+			args += strspn(args, " ");
+			if(strncmp(args, "-gap ", 5) == 0){
+	    		nextToken(&args);
+	    		value = nextToken(&args);
+	    		if(value != NULL){
+					gapClusters = strtoul(value, NULL, 10);
+	    		}
+			}
 
-		// output a directory entry not a sector (32 bytes vs 512)	
-		// printf("The first 32 byte entry in the root directory:\n");
+			if(outDir == NULL){
+	    		printf("Usage: EXTRACTALL <output directory> [-gap <clusters>] [FIND pattern and filters]\n");
+			}else{
+	    		commandFailed = !extractAll(outDir, gapClusters, args);
+			}
+    	}
+    	// here we support the EXTRACT command
+		// EXTRACT will be followed by a filename
+    	else if(strncmp(command, cmd2, 7) == 0){
+			bool          fileCopied = false;
+			unsigned long cluster;
+			DIR           fileDIREntry;
 	
-		fseek(fileptr, 0, SEEK_SET);
-		fseek(fileptr, (dataSectorStart + fatLBA) * 512, SEEK_SET);
-		fread(buffer, 32, 1, fileptr);
-		// printBytes(buffer, 32 * sizeof(unsigned char));
-
-		fseek(fileptr, 0, SEEK_SET);
-		fseek(fileptr, (dataSectorStart + fatLBA) * 512, SEEK_SET);
-		fread(sectorBuffer, 512, 1, fileptr);
-		displaySector(sectorBuffer);
-		printf("This is the data in the first sector of cluster 2 (the root directory)\n");
-	*/
-
-		// Below are the variable declarations to deal with the commands we support
-		bool quit   = false;
-		char cmd1[] = "DIR";
-		char cmd2[] = "EXTRACT";
-		char cmd3[] = "QUIT";
-		char command[256] = {'\0'};
+			// break the command into tokens, on a space and then on "\0"
+        	char *fileToRead = strtok(command, " ");
+        	fileToRead = strtok(NULL, "\0");	 // "\0" --works with 8.3   
+			if(fileToRead == NULL){
+	    		printf("No file name given.\n");
+	    		return false;
+			}
 
-		while(!quit){
-	    	printf("\nPlease enter a command:\n");
-		    printf(">");
-		    // get input here
-		    fgets(command, 256, stdin); // puts(command); - will store fgets somewhere
-
-	    	// here we will support the DIR command, will list all files in the current(root) dir
-	    	if(strncmp(command, cmd1, 3) == 0){
-				// check for files? -- need to write a function to check
-				bool isFiles = true;
-				// sector after FAT (both copies) -- where the data sector starts
-				dataSectorStart = bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * bpb.BPB_FATSz32);
-
-				if(isFiles){
-		    		printf("Files:\n");	
-
-		    		// read the directory for files
-		    		readRootDir(bpb.BPB_RootClus);
-		    		// Print a summary of the files from the root directory
-    		   		printf("\nSummary: Number of Files: %d Size of Files: %'ld\n", 
-						     numFiles, totalFileSize);
-				}
-				else{
-		    		printf("File not found\n");
-				}
-	    	}
-	    	// here we support the EXTRACT command
-			// EXTRACT will be followed by a filename
-	    	else if(strncmp(command, cmd2, 7) == 0){
-				bool          fileCopied = false;
-				unsigned long cluster;
-				DIR           fileDIREntry;
-		
-				// break the command into tokens, on a space and then on "\0"
-	        	char *fileToRead = strtok(command, " ");
-	        	fileToRead = strtok(NULL, "\0");	 // "\0" --works with 8.3   
+			// get the filename, find that file if it exists 
+			readFile(bpb.BPB_RootClus, fileToRead);	
 	
-				// get the filename, find that file if it exists 
-				readFile(bpb.BPB_RootClus, fileToRead);	
-		
-				fileDIREntry = *(DIR*)buffer;
+			fileDIREntry = *(DIR*)buffer;
     
-	        	printf("\n File to read: %s", fileToRead);
+        	printf("\n File to read: %s", fileToRead);
 
-				printf("  Size of File to be copied: %ld", fileDIREntry.DIR_FileSize);
+			printf("  Size of File to be copied: %u", fileDIREntry.DIR_FileSize);
 
-				// Consult the FAT at cluster to see if data continues
-				// printf("\nData starts in cluster: %d\n", fileDIREntry.DIR_FstClusLO);
-				cluster = fileDIREntry.DIR_FstClusLO;		
+			// Consult the FAT at cluster to see if data continues
+			// printf("\nData starts in cluster: %d\n", fileDIREntry.DIR_FstClusLO);
+			cluster = fileDIREntry.DIR_FstClusLO;		
 
-				char trimmedFileName[(strlen(fileToRead) - 4)];
-
-				// Set trimmedFileName to fileToRead minus last char 
-				int index;
-	    		for(index = 0; index < strlen(fileToRead); index++){
-		    		int c = (unsigned int)fileToRead[index];
-	            	if (c >= 32 && c <= 127){
-		    			trimmedFileName[index] = fileToRead[index];		
-	           	 	}
-				}	
-				// printf("Trimmed file Name: %s\n", trimmedFileName);
-	 		
-				// Create a new file to extract into
+			// Create a new file to extract into, the newline was already dropped from the name
  				FILE *fp;
-				fp = fopen(trimmedFileName, "w+b");
-
-				// Copy the contents of the file 
-				copyFile(cluster, fp);
-				// close the file
-				fclose(fp);
-	    	}
-	    	// here we support the QUIT command 
-	    	else if(strncmp(command, cmd3, 4) == 0){
-				quit = true;
-	   		}
-	    	// default if command is invalid
-	    	else{
-				printf("Invalid command entered, please try again.\n");
-				printf("The valid commands are:\nDIR\nEXTRACT <filename>\nQUIT\n");
-	    	}
-		}
-    }
-    else if( argc > 2 ){
-		printf("Too many arguments supplied.\n");
-    }
-    else{
-		printf("One argument expected.\n");
-    }
-
-    fclose(fileptr); 				 // Close the file
-
-    return 0;
+			fp = fopen(fileToRead, "w+b");
+
+			// Copy the contents of the file 
+			copyFile(cluster, fp);
+			// close the file
+			fclose(fp);
+    	}
+    	// here we support the FIND command
+		// FIND will be followed by a name pattern and/or filters, see parseFilter
+    	else if(strncmp(command, cmd4, 4) == 0){
+			FindFilter filter;
+
+			if(parseFilter(command + 4, &filter)){
+	    		// search the whole tree, matches are printed as they are found
+	    		walkDir(bpb.BPB_RootClus, "", findCallback, &filter, true);
+	    		printf("\nSummary: Number of Matches: %d\n", filter.numMatches);
+	    		freeFilter(&filter);
+			}
+    	}
+    	// here we support the EXPORT command
+		// EXPORT will be followed by the format (csv, jsonl or bin) and the output file
+    	else if(strncmp(command, cmd5, 6) == 0){
+			char *args       = command + 6;
+			char *formatName = nextToken(&args);
+			char *outName    = nextToken(&args);
+
+			if(formatName == NULL || outName == NULL){
+	    		printf("Usage: EXPORT <csv|jsonl|bin> <output file>\n");
+			}else{
+	    		commandFailed = !exportMetadata(formatName, outName);
+			}
+    	}
+    	// here we support the TAR command
+		// TAR will be followed by the output file (- for stdout), a directory and optional filters
+    	else if(strncmp(command, cmd6, 3) == 0){
+			char *args    = command + 3;
+			char *outName = nextToken(&args);
+			char *dirPath = nextToken(&args);
+
+			if(outName == NULL || dirPath == NULL){
+	    		printf("Usage: TAR <output file | -> <directory> [FIND pattern and filters]\n");
+			}else{
+	    		commandFailed = !writeTar(outName, dirPath, args);
+			}
+    	}
+    	// here we support the SNAPSHOT command
+		// SNAPSHOT will be followed by the file to save the snapshot in
+    	else if(strncmp(command, cmd8, 8) == 0){
+			char     *args     = command + 8;
+			char     *fileName = nextToken(&args);
+			Snapshot snap;
+
+			if(fileName == NULL){
+	    		printf("Usage: SNAPSHOT <output file>\n");
+			}else{
+	    		memset(&snap, 0, sizeof(snap));
+	    		buildSnapshot(&snap, NULL);
+	    		commandFailed = !saveSnapshot(&snap, fileName);
+	    		if(!commandFailed){
+					printf("Saved %d entries in %d directories to %s\n",
+					       snap.numEntries, snap.numDirs, fileName);
+	    		}
+	    		freeSnapshot(&snap);
+			}
+    	}
+    	// here we support the DIFF command
+		// DIFF will be followed by a snapshot file or another image to compare against
+    	else if(strncmp(command, cmd9, 4) == 0){
+			char *args      = command + 4;
+			char *otherName = nextToken(&args);
+
+			if(otherName == NULL){
+	    		printf("Usage: DIFF <snapshot file | image>\n");
+			}else{
+	    		commandFailed = !diffImage(otherName);
+			}
+    	}
+    	// here we support the STORE command
+		// STORE will be followed by the store directory, the manifest directory and filters
+    	else if(strncmp(command, cmd10, 5) == 0){
+			char *args        = command + 5;
+			char *storeDir    = nextToken(&args);
+			char *manifestDir = nextToken(&args);
+
+			if(storeDir == NULL || manifestDir == NULL){
+	    		printf("Usage: STORE <store directory> <manifest directory> [FIND pattern and filters]\n");
+			}else{
+	    		commandFailed = !storeAll(storeDir, manifestDir, args);
+			}
+    	}
+    	// here we support the QUIT command 
+    	else if(strncmp(command, cmd3, 4) == 0){
+			return true;
+   		}
+    	// default if command is invalid
+    	else{
+			printf("Invalid command entered, please try again.\n");
+			printf("The valid commands are:\nDIR\nEXTRACT <filename>\n");
+			printf("FIND [pattern] [-regex <expr>] [-size <min>-<max>] [-attr <RHSDA>]\n");
+			printf("     [-crt <from>:<to>] [-wrt <from>:<to>]\n");
+			printf("EXPORT <csv|jsonl|bin> <output file>\n");
+			printf("TAR <output file | -> <directory> [FIND pattern and filters]\n");
+			printf("EXTRACTALL <output directory> [-gap <clusters>] [FIND pattern and filters]\n");
+			printf("SNAPSHOT <output file>\nDIFF <snapshot file | image>\n");
+			printf("STORE <store directory> <manifest directory> [FIND pattern and filters]\nQUIT\n");
+    	}
+    return false;
 }
 
 // function to print the elements of an array in hexadecimal
@@ -416,41 +927,49 @@ void readEntry(unsigned long sectorNum, unsigned long entryNum, unsigned char *b
 // Date & Time of creation Size          Filename(8.3 and LFN formats)
 // 04/20/2021  01:09 PM    1,024,450,560 CFIMAG~1.IMG CFImage32.img
 void printFileEntry(){
-    dirEntry = *(DIR*)buffer;
+    int year, month, day, hour, minute, second;
 
-    // example to return an int from bits
-    // int day   = (((1 << j) - 1) & (dirEntry.DIR_CrtDate >> (i)));
-    // where i is the start position and j is the number of bits to read
-    int day   = (((1 << 5) - 1) & (dirEntry.DIR_CrtDate >> (0)));
-    int month = (((1 << 4) - 1) & (dirEntry.DIR_CrtDate >> (5)));
-    int year  = 1980 + (((1 << 7) - 1) & (dirEntry.DIR_CrtDate >> (9)));
+    dirEntry = *(DIR*)buffer;
 
-    printf("\n%02d/%2d/%d ", month, day, year);
+    decodeDate(dirEntry.DIR_CrtDate, &year, &month, &day);
+    printf("\n%02d/%02d/%d ", month, day, year);
 
-    int hour   = (((1 << 5) - 1) & (dirEntry.DIR_CrtTime >> 11));
-    int minute = (((1 << 6) - 1) & (dirEntry.DIR_CrtTime >> 5));
-    char period[2] = "AM";
+    decodeTime(dirEntry.DIR_CrtTime, &hour, &minute, &second);
+    char period[3] = "AM";
     if(hour > 12){
 		period[0] = 'P';
-		period[1] = 'M';
 		hour   = hour - 12;
-    }else if(hour = 0){
+    }else if(hour == 0){
 		hour   = 12;
-    }else if(hour = 12){
+    }else if(hour == 12){
 		period[0] = 'P';
-		period[1] = 'M';
     }
 
-    printf("%2d:%2d %s", hour, minute, period);
+    printf("%2d:%02d %s", hour, minute, period);
 
-    int fileSize = (unsigned int)dirEntry.DIR_FileSize;
+    unsigned int fileSize = dirEntry.DIR_FileSize;
     totalFileSize = totalFileSize + fileSize;
-    setlocale(LC_ALL, "");
-    printf(" %'10d ", fileSize);
+    printf(" %'10u ", fileSize);
 
     // printf("\nEntry Attr: %02X ", thisDirEntry.DIR_Attr);	
 }
 
+// example to return an int from bits
+// int day   = (((1 << j) - 1) & (dirEntry.DIR_CrtDate >> (i)));
+// where i is the start position and j is the number of bits to read
+void decodeDate(unsigned short date, int *year, int *month, int *day){
+    *day   = (((1 << 5) - 1) & (date >> 0));
+    *month = (((1 << 4) - 1) & (date >> 5));
+    *year  = 1980 + (((1 << 7) - 1) & (date >> 9));
+}
+
+// FAT times only have 2 second resolution
+void decodeTime(unsigned short time, int *hour, int *minute, int *second){
+    *hour   = (((1 << 5) - 1) & (time >> 11));
+    *minute = (((1 << 6) - 1) & (time >> 5));
+    *second = (((1 << 5) - 1) & time) * 2;
+}
+
 void copyFile(unsigned long cluster, FILE *fp){
     bool fileCopied = false;
     int  i, j, k;
@@ -491,8 +1010,8 @@ void copyFile(unsigned long cluster, FILE *fp){
 void readFile(unsigned long cluster, char *fileToRead){
     bool          fileRead = false;
     int           i, j, k;               // indexing/loop variables
-    unsigned char fileName[12];          // the name of the file as it is stored
-    unsigned char fileNameNoPadding[12]; // the name of the file we will format and work with
+    unsigned char fileName[13] = {0};    // the name of the file as it is stored, with room for the dot
+    unsigned char fileNameNoPadding[13]; // the name of the file we will format and work with
     DIR           thisDirEntry;          // current 32-byte entry
     DIR           newFile;
     bool          LFN = false;           // 8.3 or LFN?
@@ -589,7 +1108,11 @@ void readFile(unsigned long cluster, char *fileToRead){
 
 					// increment counter to read the previosu entry
 					counter++;
-    		    }while(checkSum == thisDirEntry.LDIR_Chksum);
+					// stop before longFileName is full, an LFN run can start in the previous sector,
+					// which readEntry reaches with a negative entry number
+    		    }while(checkSum == thisDirEntry.LDIR_Chksum &&
+    		           longFileNameIndex + 13 < (int)sizeof(longFileName));
+    		    longFileName[longFileNameIndex] = '\0';
 /*
 			printf("\nLong File Name: %s", longFileName);
 			printf(" LFN strlen: %d", strlen(longFileName));
@@ -625,8 +1148,8 @@ void readFile(unsigned long cluster, char *fileToRead){
 // Send the FIRST cluster of the root directory 
 void readRootDir(unsigned long cluster){
     int           i, j, k;               // indexing/loop variables
-    unsigned char fileName[12];          // the name of the file as it is stored
-    unsigned char fileNameNoPadding[12]; // the name of the file we will format and work with
+    unsigned char fileName[13] = {0};    // the name of the file as it is stored, with room for the dot
+    unsigned char fileNameNoPadding[13]; // the name of the file we will format and work with
     DIR           thisDirEntry;          // current 32-byte entry
     bool          LFN = false;           // 8.3 or LFN?
     unsigned long nextCluster;           // the next cluster 
@@ -731,7 +1254,11 @@ void readRootDir(unsigned long cluster){
 
 						// increment counter to read the previosu entry
 						counter++;
-    				}while(checkSum == thisDirEntry.LDIR_Chksum);
+						// stop before longFileName is full, an LFN run can start in the previous sector,
+						// which readEntry reaches with a negative entry number
+    				}while(checkSum == thisDirEntry.LDIR_Chksum &&
+    				       longFileNameIndex + 13 < (int)sizeof(longFileName));
+    				longFileName[longFileNameIndex] = '\0';
 		    		int prtCtr;
 		    		for(prtCtr = 0; prtCtr < strlen(longFileName); prtCtr++){
 						if(longFileName[prtCtr] != 0x0000){
@@ -808,8 +1335,31 @@ void removeSpaces(unsigned char old[], unsigned char new[]){
 }
 
 
+// Read the first copy of the FAT into fatTable so following chains needs no seeks
+bool loadFAT(){
+    numFATEntries = sectorsPerFAT * 512 / 4;
+    fatTable      = malloc(sectorsPerFAT * 512);
+    fseek(fileptr, (fatLBA + reservedSectors) * 512, SEEK_SET);
+    if(fatTable == NULL || fread(fatTable, sectorsPerFAT * 512, 1, fileptr) != 1){
+		free(fatTable);
+		fatTable      = NULL;
+		numFATEntries = 0;
+		return false;
+    }
+    return true;
+}
+
 unsigned long readFAT(unsigned long cluster){
     unsigned long nextCluster;
+
+    // use the FAT in memory, and only read one sector at a time if it could not be loaded
+    if(fatTable == NULL){
+		loadFAT();
+    }
+    if(fatTable != NULL){
+		return cluster < numFATEntries ? fatTable[cluster] : 0x0FFFFFFF;
+    }
+
     // goto start of the fat and then the sector this cluster is in
     fseek(fileptr, ((fatLBA + reservedSectors + ((int)cluster / 128)) * 512), SEEK_SET);	
     fread(sectorBuffer, 512, 1, fileptr);
@@ -821,4 +1371,2478 @@ unsigned long readFAT(unsigned long cluster){
     return nextCluster;
 }
 
+// Push the directory at cluster on walkStack, false if the tree is already WALK_MAX_DEPTH deep
+bool enterDir(unsigned long cluster){
+    if(walkDepth == WALK_MAX_DEPTH){
+		return false;
+    }
+    walkStack[walkDepth] = cluster;
+    walkDepth++;
+    return true;
+}
+
+void leaveDir(void){
+    walkDepth--;
+}
+
+// Is the directory at cluster one of the directories being walked? A subdirectory that
+// points back at one of them would make the walk go round forever
+bool dirOnStack(unsigned long cluster){
+    int i;
+
+    for(i = 0; i < walkDepth; i++){
+		if(walkStack[i] == cluster){
+	    	return true;
+		}
+    }
+    return false;
+}
+
+// Is cluster one of the first length clusters of chain? A directory chain that comes back to
+// a cluster it already went through loops, directories are short so a plain search will do
+bool clusterSeen(unsigned long *chain, unsigned long length, unsigned long cluster){
+    unsigned long i;
+
+    for(i = 0; i < length; i++){
+		if(chain[i] == cluster){
+	    	return true;
+		}
+    }
+    return false;
+}
+
+// Walk every entry of the directory starting at cluster and, if recursive, its subdirectories
+// Each directory cluster is read whole (or from the cache) instead of once per 32-byte entry,
+// and LFN entries are only copied here, callbacks decode them if they need the name
+bool walkDir(unsigned long cluster, const char *path, WalkCallback callback, void *context,
+		     bool recursive){
+    unsigned long bytesPerCluster = sectorsPerCluster * 512;
+    unsigned long maxClusters     = DIR_MAX_ENTRIES * 32 / bytesPerCluster + 1;
+    unsigned char *clusterBuffer;
+    unsigned long *chain;
+    char          *subPath;
+    DirItem       item;
+    DIR           *entry;
+    bool          keepGoing = true;
+    bool          endOfDir  = false;
+    unsigned long i, steps;
+    int           k;
+    unsigned char checkSum;
+
+    if(!enterDir(cluster)){
+		return true;
+    }
+    clusterBuffer = malloc(bytesPerCluster);
+    chain         = malloc(maxClusters * sizeof(unsigned long));
+    subPath       = malloc(PATH_MAX);
+    item.numLFN   = 0;
+    item.dirPath  = path;
+
+    for(steps = 0; cluster >= 2 && cluster < 0x0FFFFFF7 && steps < maxClusters &&
+		           keepGoing && !endOfDir; steps++){
+		if(clusterSeen(chain, steps, cluster) || !readDirCluster(cluster, clusterBuffer)){
+	    	break;
+		}
+		chain[steps] = cluster;
+
+		for(i = 0; i < bytesPerCluster / 32 && keepGoing && !endOfDir; i++){
+	    	entry = (DIR*)(clusterBuffer + i * 32);
+
+	    	if(entry->DIR_Name[0] == 0x00){
+				// no more entries in this directory
+				endOfDir = true;
+	    	}else if(entry->DIR_Name[0] == 0xE5){
+				// this entry is unused
+				item.numLFN = 0;
+	    	}else if(entry->DIR_Attr == 0x0F){
+				// LFN entry, the first one of a name has bit 6 of the order set
+				if(entry->LDIR_Ord & 0x40){
+		    		item.numLFN = 0;
+				}
+				if(item.numLFN < 20){
+		    		item.lfnEntries[item.numLFN] = *entry;
+		    		item.numLFN++;
+				}else{
+		    		// longer than any valid name, the rest has no first entry and is dropped
+		    		item.numLFN = 0;
+				}
+	    	}else if(entry->DIR_Attr & 0x08){
+				// This is the name of the volume
+				item.numLFN = 0;
+	    	}else{
+				item.entry = *entry;
+
+				// only keep the LFN entries if they belong to this 8.3 entry: same checksum and
+				// ordinals counting down to 1, with bit 6 set on the first one only
+				checkSum = ChkSum(entry->DIR_Name);
+				for(k = 0; k < item.numLFN; k++){
+		    		unsigned char ord = item.lfnEntries[k].LDIR_Ord;
+
+		    		if(item.lfnEntries[k].LDIR_Chksum != checkSum ||
+		       		   (ord & 0x1F) != item.numLFN - k || ((ord & 0x40) != 0) != (k == 0)){
+						item.numLFN = 0;
+		    		}
+				}
+
+				// skip the . and .. entries so we do not walk in circles
+				if(entry->DIR_Name[0] != '.'){
+		    		keepGoing = callback(&item, context);
+
+		    		if(keepGoing && recursive && (entry->DIR_Attr & 0x10) &&
+		       		   !dirOnStack(getNextCluster(item.entry))){
+						getItemPath(&item, subPath);
+						keepGoing = walkDir(getNextCluster(item.entry), subPath, callback, context, true);
+		    		}
+				}
+				item.numLFN = 0;
+	    	}
+		}
+		cluster = readFAT(cluster) & 0x0FFFFFFF;
+    }
+
+    free(clusterBuffer);
+    free(chain);
+    free(subPath);
+    leaveDir();
+    return keepGoing;
+}
+
+// Format the 8.3 name of an entry as NAME.EXT without the padding
+void getShortName(DIR *entry, char name[13]){
+    int i, n = 0;
+
+    for(i = 0; i < 8 && entry->DIR_Name[i] != ' '; i++){
+		name[n] = entry->DIR_Name[i];
+		n++;
+    }
+    // 0x05 is stored in place of a real 0xE5 first character
+    if(n > 0 && (unsigned char)name[0] == 0x05){
+		name[0] = 0xE5;
+    }
+    if(entry->DIR_Name[8] != ' '){
+		name[n] = '.';
+		n++;
+		for(i = 8; i < 11 && entry->DIR_Name[i] != ' '; i++){
+	    	name[n] = entry->DIR_Name[i];
+	    	n++;
+		}
+    }
+    name[n] = '\0';
+}
+
+// Decode the LFN entries of an item into a UTF-8 name, falls back to the 8.3 name
+// The name is cut at 255 characters or size bytes (MAX_NAME_BYTES fits every name)
+void getLongName(DirItem *item, char name[], size_t size){
+    int            i, k, numChars = 0;
+    size_t         n = 0;
+    bool           done = false;
+    unsigned short chars[13];
+    unsigned short c;
+
+    if(item->numLFN == 0){
+		getShortName(&item->entry, name);
+		return;
+    }
+
+    // the LFN entries are stored last part first, so go through them backwards
+    for(i = item->numLFN - 1; i >= 0 && !done; i--){
+		memcpy(chars,      item->lfnEntries[i].LDIR_Name1, 10);
+		memcpy(chars + 5,  item->lfnEntries[i].LDIR_Name2, 12);
+		memcpy(chars + 11, item->lfnEntries[i].LDIR_Name3, 4);
+
+		for(k = 0; k < 13 && !done; k++){
+	    	c = chars[k];
+	    	if(c == 0x0000 || c == 0xFFFF || numChars == 255 || n + 4 > size){
+				// a name without a terminator stops at the limit
+				done = true;
+	    	}else if(c < 0x80){
+				name[n++] = c;
+	    	}else if(c < 0x800){
+				name[n++] = 0xC0 | (c >> 6);
+				name[n++] = 0x80 | (c & 0x3F);
+	    	}else{
+				name[n++] = 0xE0 | (c >> 12);
+				name[n++] = 0x80 | ((c >> 6) & 0x3F);
+				name[n++] = 0x80 | (c & 0x3F);
+	    	}
+	    	if(!done){
+				numChars++;
+	    	}
+		}
+    }
+    name[n] = '\0';
+}
+
+// The name of an item as one path component that cannot leave its directory, names come
+// from the image and may hold anything. '/' and '\' become '_', and so do the dots of
+// a name that is "." or "..", an empty name becomes "_"
+void getSafeName(DirItem *item, char name[], size_t size){
+    size_t i;
+
+    getLongName(item, name, size);
+    for(i = 0; name[i] != '\0'; i++){
+		if(name[i] == '/' || name[i] == '\\'){
+	    	name[i] = '_';
+		}
+    }
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+		memset(name, '_', strlen(name));
+    }else if(name[0] == '\0'){
+		strcpy(name, "_");
+    }
+}
+
+// Full path of an item, e.g. /Sub Folder/notes.txt, built from safe names
+void getItemPath(DirItem *item, char path[]){
+    char name[MAX_NAME_BYTES];
+
+    getSafeName(item, name, sizeof(name));
+    snprintf(path, PATH_MAX, "%s/%s", item->dirPath, name);
+}
+
+// Return the next space separated word of *cursor, "double quotes" keep spaces in a word
+char* nextToken(char **cursor){
+    char *start = *cursor;
+    char *end;
+
+    while(*start == ' '){
+		start++;
+    }
+    if(*start == '\0'){
+		return NULL;
+    }
+
+    if(*start == '"'){
+		start++;
+		end = strchr(start, '"');
+    }else{
+		end = strchr(start, ' ');
+    }
+
+    if(end == NULL){
+		*cursor = start + strlen(start);
+    }else{
+		*end    = '\0';
+		*cursor = end + 1;
+    }
+    return start;
+}
+
+// Turn YYYY-MM-DD into the packed FAT date format (bits 15-9 year, 8-5 month, 4-0 day)
+// packed dates compare the same way as the dates themselves
+bool parseDate(const char *text, unsigned short *date){
+    int year, month, day;
+
+    if(sscanf(text, "%d-%d-%d", &year, &month, &day) != 3 || year < 1980 || year > 2107 ||
+       month < 1 || month > 12 || day < 1 || day > 31){
+		return false;
+    }
+    *date = ((year - 1980) << 9) | (month << 5) | day;
+    return true;
+}
+
+// Parse <from>:<to> where either end may be left off
+bool parseDateRange(char *text, unsigned short *from, unsigned short *to){
+    char *split = strchr(text, ':');
+
+    if(split == NULL){
+		return parseDate(text, from) && parseDate(text, to);
+    }
+    *split = '\0';
+    if(*text != '\0' && !parseDate(text, from)){
+		return false;
+    }
+    if(*(split + 1) != '\0' && !parseDate(split + 1, to)){
+		return false;
+    }
+    return true;
+}
+
+// Parse a byte count with an optional K, M or G suffix
+bool parseSize(const char *text, unsigned long *size){
+    char *end;
+
+    *size = strtoul(text, &end, 10);
+    if(end == text){
+		return false;
+    }
+    switch(*end){
+		case 'K': case 'k': *size <<= 10; end++; break;
+		case 'M': case 'm': *size <<= 20; end++; break;
+		case 'G': case 'g': *size <<= 30; end++; break;
+    }
+    return *end == '\0';
+}
+
+// Parse <min>-<max> where either end may be left off, a single size is an exact match
+bool parseSizeRange(char *text, unsigned long *min, unsigned long *max){
+    char *split = strchr(text, '-');
+
+    if(split == NULL){
+		return parseSize(text, min) && parseSize(text, max);
+    }
+    *split = '\0';
+    if(*text != '\0' && !parseSize(text, min)){
+		return false;
+    }
+    if(*(split + 1) != '\0' && !parseSize(split + 1, max)){
+		return false;
+    }
+    return true;
+}
+
+// Parse attribute letters (R H S D A) or a number like 0x10 into an attribute mask
+bool parseAttr(const char *text, unsigned char *mask){
+    char *end;
+
+    if(*text >= '0' && *text <= '9'){
+		*mask = strtoul(text, &end, 0);
+		return *end == '\0';
+    }
+    *mask = 0;
+    for(; *text != '\0'; text++){
+		switch(*text){
+	    	case 'R': case 'r': *mask |= 0x01; break;
+	    	case 'H': case 'h': *mask |= 0x02; break;
+	    	case 'S': case 's': *mask |= 0x04; break;
+	    	case 'D': case 'd': *mask |= 0x10; break;
+	    	case 'A': case 'a': *mask |= 0x20; break;
+	    	default:            return false;
+		}
+    }
+    return true;
+}
+
+// Fill in filter from the words after FIND, prints what is wrong and returns false on bad input
+bool parseFilter(char *args, FindFilter *filter){
+    char *word;
+    char *value;
+    bool ok = true;
+
+    filter->pattern    = NULL;
+    filter->useRegex   = false;
+    filter->minSize    = 0;
+    filter->maxSize    = ULONG_MAX;
+    filter->attrMask   = 0;
+    filter->crtFrom    = 0;
+    filter->crtTo      = 0xFFFF;
+    filter->wrtFrom    = 0;
+    filter->wrtTo      = 0xFFFF;
+    filter->numMatches = 0;
+
+    while(ok && (word = nextToken(&args)) != NULL){
+		if(word[0] != '-'){
+	    	filter->pattern = word;
+	    	continue;
+		}
+
+		value = nextToken(&args);
+		if(value == NULL){
+	    	printf("Missing value for %s\n", word);
+	    	ok = false;
+		}else if(strcmp(word, "-regex") == 0){
+	    	if(filter->useRegex){
+				regfree(&filter->regex);
+	    	}
+	    	filter->useRegex = regcomp(&filter->regex, value, REG_EXTENDED | REG_ICASE | REG_NOSUB) == 0;
+	    	if(!filter->useRegex){
+				printf("Invalid regular expression: %s\n", value);
+				ok = false;
+	    	}
+		}else if(strcmp(word, "-size") == 0){
+	    	ok = parseSizeRange(value, &filter->minSize, &filter->maxSize);
+		}else if(strcmp(word, "-attr") == 0){
+	    	ok = parseAttr(value, &filter->attrMask);
+		}else if(strcmp(word, "-crt") == 0){
+	    	ok = parseDateRange(value, &filter->crtFrom, &filter->crtTo);
+		}else if(strcmp(word, "-wrt") == 0){
+	    	ok = parseDateRange(value, &filter->wrtFrom, &filter->wrtTo);
+		}else{
+	    	printf("Unknown filter: %s\n", word);
+	    	ok = false;
+		}
+
+		if(!ok && value != NULL){
+	    	printf("Invalid value for %s\n", word);
+		}
+    }
+
+    if(!ok){
+		freeFilter(filter);
+    }
+    return ok;
+}
+
+void freeFilter(FindFilter *filter){
+    if(filter->useRegex){
+		regfree(&filter->regex);
+		filter->useRegex = false;
+    }
+}
+
+bool matchName(const char *name, FindFilter *filter){
+    if(filter->useRegex){
+		return regexec(&filter->regex, name, 0, NULL, 0) == 0;
+    }
+    return fnmatch(filter->pattern, name, FNM_CASEFOLD) == 0;
+}
+
+// Check an item against the filter, the checks that only need the 32-byte entry go first
+// so the long name is only decoded for entries that pass them and fail the 8.3 name
+bool matchFilter(DirItem *item, FindFilter *filter){
+    DIR  *entry = &item->entry;
+    char shortName[13];
+    char longName[MAX_NAME_BYTES];
+
+    if((entry->DIR_Attr & filter->attrMask) != filter->attrMask){
+		return false;
+    }
+    if(entry->DIR_FileSize < filter->minSize || entry->DIR_FileSize > filter->maxSize){
+		return false;
+    }
+    if(entry->DIR_CrtDate < filter->crtFrom || entry->DIR_CrtDate > filter->crtTo){
+		return false;
+    }
+    if(entry->DIR_WrtDate < filter->wrtFrom || entry->DIR_WrtDate > filter->wrtTo){
+		return false;
+    }
+    if(filter->pattern == NULL && !filter->useRegex){
+		return true;
+    }
+
+    getShortName(entry, shortName);
+    if(matchName(shortName, filter)){
+		return true;
+    }
+    if(item->numLFN == 0){
+		return false;
+    }
+    getLongName(item, longName, sizeof(longName));
+    return matchName(longName, filter);
+}
+
+// Print the path of every item that passes the filter as soon as it is found
+bool findCallback(DirItem *item, void *context){
+    FindFilter *filter = (FindFilter*)context;
+    char       path[PATH_MAX];
+
+    if(matchFilter(item, filter)){
+		getItemPath(item, path);
+		printf("%s\n", path);
+		filter->numMatches++;
+    }
+    return true;
+}
+
+void appendBytes(ByteBuffer *buf, const void *data, size_t n){
+    if(n == 0){
+		return;
+    }
+    if(buf->used + n > buf->size){
+		size_t size = (buf->used + n) * 2;
+		unsigned char *grown = realloc(buf->data, size);
+		if(grown == NULL){
+			printf("Out of memory\n");
+			buf->failed = true;
+			return;
+		}
+		buf->data = grown;
+		buf->size = size;
+    }
+    memcpy(buf->data + buf->used, data, n);
+    buf->used += n;
+}
+
+// Append a number in decimal, zero padded to width digits
+void appendNumber(ByteBuffer *buf, unsigned long number, int width){
+    char digits[20];
+    int  n = 0;
+
+    do{
+		digits[19 - n] = '0' + number % 10;
+		number /= 10;
+		n++;
+    }while(number > 0 || n < width);
+    appendBytes(buf, digits + 20 - n, n);
+}
+
+// Append a FAT date (and time) as YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS[.cc]
+// tenth is DIR_CrtTimeTenth or -1 for times without hundredths
+void appendTimestamp(ByteBuffer *buf, unsigned short date, unsigned short time,
+			         int tenth, bool hasTime){
+    int year, month, day, hour, minute, second;
+
+    decodeDate(date, &year, &month, &day);
+    appendNumber(buf, year, 4);
+    appendBytes(buf, "-", 1);
+    appendNumber(buf, month, 2);
+    appendBytes(buf, "-", 1);
+    appendNumber(buf, day, 2);
+
+    if(hasTime){
+		decodeTime(time, &hour, &minute, &second);
+		appendBytes(buf, "T", 1);
+		appendNumber(buf, hour, 2);
+		appendBytes(buf, ":", 1);
+		appendNumber(buf, minute, 2);
+		appendBytes(buf, ":", 1);
+		if(tenth < 0){
+	    	appendNumber(buf, second, 2);
+		}else{
+	    	// DIR_CrtTimeTenth counts 10ms units from 0 to 199, so it can add a second
+	    	appendNumber(buf, second + tenth / 100, 2);
+	    	appendBytes(buf, ".", 1);
+	    	appendNumber(buf, tenth % 100, 2);
+		}
+    }
+}
+
+// Start the next field of a row, a comma for CSV or the key for JSON
+void appendFieldName(ExportState *state, const char *name, bool first){
+    if(state->format == EXPORT_CSV){
+		if(!first){
+	    	appendBytes(&state->rows, ",", 1);
+		}
+		return;
+    }
+    appendBytes(&state->rows, first ? "{\"" : ",\"", 2);
+    appendBytes(&state->rows, name, strlen(name));
+    appendBytes(&state->rows, "\":", 2);
+}
+
+// Append a timestamp field, unset dates are empty in CSV and null in JSON
+void appendTimeField(ExportState *state, const char *name, unsigned short date,
+				     unsigned short time, int tenth, bool hasTime){
+    appendFieldName(state, name, false);
+    if(date == 0){
+		if(state->format == EXPORT_JSONL){
+	    	appendBytes(&state->rows, "null", 4);
+		}
+		return;
+    }
+    if(state->format == EXPORT_JSONL){
+		appendBytes(&state->rows, "\"", 1);
+    }
+    appendTimestamp(&state->rows, date, time, tenth, hasTime);
+    if(state->format == EXPORT_JSONL){
+		appendBytes(&state->rows, "\"", 1);
+    }
+}
+
+// Append a quoted string, escaped for CSV or JSON
+void appendEscaped(ByteBuffer *buf, const char *text, int format){
+    appendBytes(buf, "\"", 1);
+    for(; *text != '\0'; text++){
+		unsigned char c = *text;
+
+		if(c == '"'){
+	    	appendBytes(buf, format == EXPORT_CSV ? "\"\"" : "\\\"", 2);
+		}else if(c == '\\' && format == EXPORT_JSONL){
+	    	appendBytes(buf, "\\\\", 2);
+		}else if(c < 0x20 && format == EXPORT_JSONL){
+	    	appendBytes(buf, "\\u00", 4);
+	    	appendBytes(buf, &"0123456789abcdef"[c >> 4], 1);
+	    	appendBytes(buf, &"0123456789abcdef"[c & 0xF], 1);
+		}else{
+	    	appendBytes(buf, &c, 1);
+		}
+    }
+    appendBytes(buf, "\"", 1);
+}
+
+// Write everything batched so far to the output file
+void flushExport(ExportState *state){
+    int          col;
+    unsigned int length;
 
+    if(state->format != EXPORT_BIN){
+		if(fwrite(state->rows.data, 1, state->rows.used, state->out) != state->rows.used ||
+		   state->rows.failed){
+	    	state->failed = true;
+		}
+		state->rows.used = 0;
+		return;
+    }
+    if(state->batchRows == 0){
+		return;
+    }
+    if(fwrite(&state->batchRows, 4, 1, state->out) != 1){
+		state->failed = true;
+    }
+    for(col = 0; col < NUM_COLUMNS; col++){
+		length = state->columns[col].used;
+		if(fwrite(&length, 4, 1, state->out) != 1 ||
+		   fwrite(state->columns[col].data, 1, length, state->out) != length ||
+		   state->columns[col].failed){
+	    	state->failed = true;
+		}
+		state->columns[col].used = 0;
+    }
+    state->batchRows = 0;
+}
+
+// Add one entry to the export batch and write the batch out once it is full
+bool exportCallback(DirItem *item, void *context){
+    ExportState  *state = (ExportState*)context;
+    ByteBuffer   *rows  = &state->rows;
+    ByteBuffer   *cols  = state->columns;
+    DIR          *entry = &item->entry;
+    char         shortName[13];
+    char         longName[MAX_NAME_BYTES];
+    char         path[PATH_MAX];
+    unsigned int cluster = getNextCluster(*entry);
+    unsigned int end;
+
+    // decode the long name once and build the path from it
+    getShortName(entry, shortName);
+    getLongName(item, longName, sizeof(longName));
+    snprintf(path, PATH_MAX, "%s/%s", item->dirPath, longName);
+    if(item->numLFN == 0){
+		longName[0] = '\0';
+    }
+
+    if(state->format == EXPORT_BIN){
+		appendBytes(&cols[COL_SIZE],      &entry->DIR_FileSize, 4);
+		appendBytes(&cols[COL_CLUSTER],   &cluster, 4);
+		appendBytes(&cols[COL_ATTR],      &entry->DIR_Attr, 1);
+		appendBytes(&cols[COL_CRT_DATE],  &entry->DIR_CrtDate, 2);
+		appendBytes(&cols[COL_CRT_TIME],  &entry->DIR_CrtTime, 2);
+		appendBytes(&cols[COL_CRT_TENTH], &entry->DIR_CrtTimeTenth, 1);
+		appendBytes(&cols[COL_WRT_DATE],  &entry->DIR_WrtDate, 2);
+		appendBytes(&cols[COL_WRT_TIME],  &entry->DIR_WrtTime, 2);
+		appendBytes(&cols[COL_ACC_DATE],  &entry->DIR_LstAccDate, 2);
+
+		appendBytes(&cols[COL_PATH], path, strlen(path));
+		end = cols[COL_PATH].used;
+		appendBytes(&cols[COL_PATH_END], &end, 4);
+		appendBytes(&cols[COL_SHORT], shortName, strlen(shortName));
+		end = cols[COL_SHORT].used;
+		appendBytes(&cols[COL_SHORT_END], &end, 4);
+		appendBytes(&cols[COL_LONG], longName, strlen(longName));
+		end = cols[COL_LONG].used;
+		appendBytes(&cols[COL_LONG_END], &end, 4);
+
+		state->batchRows++;
+		if(state->batchRows == EXPORT_BATCH_ROWS){
+	    	flushExport(state);
+		}
+    }else{
+		appendFieldName(state, "path", true);
+		appendEscaped(rows, path, state->format);
+		appendFieldName(state, "short_name", false);
+		appendEscaped(rows, shortName, state->format);
+		appendFieldName(state, "long_name", false);
+		appendEscaped(rows, longName, state->format);
+		appendFieldName(state, "size", false);
+		appendNumber(rows, entry->DIR_FileSize, 1);
+		appendFieldName(state, "first_cluster", false);
+		appendNumber(rows, cluster, 1);
+		appendFieldName(state, "attr", false);
+		appendNumber(rows, entry->DIR_Attr, 1);
+		appendTimeField(state, "created", entry->DIR_CrtDate, entry->DIR_CrtTime,
+					    entry->DIR_CrtTimeTenth, true);
+		appendTimeField(state, "written", entry->DIR_WrtDate, entry->DIR_WrtTime, -1, true);
+		appendTimeField(state, "accessed", entry->DIR_LstAccDate, 0, -1, false);
+		appendBytes(rows, state->format == EXPORT_CSV ? "\n" : "}\n",
+				    state->format == EXPORT_CSV ? 1 : 2);
+
+		if(rows->used >= EXPORT_BATCH_BYTES){
+	    	flushExport(state);
+		}
+    }
+    state->numRows++;
+    // stop the walk once a write has failed
+    return !state->failed;
+}
+
+// Stream the metadata of every entry on the drive to outName
+bool exportMetadata(char *formatName, char *outName){
+    ExportState state;
+    int         col;
+
+    memset(&state, 0, sizeof(state));
+    if(strcmp(formatName, "csv") == 0){
+		state.format = EXPORT_CSV;
+    }else if(strcmp(formatName, "jsonl") == 0){
+		state.format = EXPORT_JSONL;
+    }else if(strcmp(formatName, "bin") == 0){
+		state.format = EXPORT_BIN;
+    }else{
+		printf("Unknown export format: %s\n", formatName);
+		return false;
+    }
+
+    state.out = fopen(outName, "wb");
+    if(state.out == NULL){
+		printf("Could not open %s: %s\n", outName, strerror(errno));
+		return false;
+    }
+
+    if(state.format == EXPORT_CSV){
+		const char *header = "path,short_name,long_name,size,first_cluster,attr,created,written,accessed\n";
+		appendBytes(&state.rows, header, strlen(header));
+    }else if(state.format == EXPORT_BIN){
+		state.failed = fwrite("F32COLS1", 1, 8, state.out) != 8;
+    }
+
+    walkDir(bpb.BPB_RootClus, "", exportCallback, &state, true);
+    flushExport(&state);
+    if(fclose(state.out) != 0){
+		state.failed = true;
+    }
+
+    free(state.rows.data);
+    for(col = 0; col < NUM_COLUMNS; col++){
+		free(state.columns[col].data);
+    }
+    if(state.failed){
+		printf("Could not write %s: %s\n", outName, strerror(errno));
+		return false;
+    }
+    printf("Exported %lu entries to %s\n", state.numRows, outName);
+    return true;
+}
+
+// Stop the walk at the entry whose 8.3 or long name is state->name
+bool lookupCallback(DirItem *item, void *context){
+    LookupState *state = (LookupState*)context;
+    char        name[MAX_NAME_BYTES];
+
+    getShortName(&item->entry, name);
+    if(strcasecmp(name, state->name) != 0){
+		getLongName(item, name, sizeof(name));
+		if(strcasecmp(name, state->name) != 0){
+	    	return true;
+		}
+    }
+    *state->found  = *item;
+    state->matched = true;
+    return false;
+}
+
+// Find the entry for a path like /Sub Folder/Deep, each name can be the 8.3 or the long
+// name and case is ignored. "/" gives a directory entry for the root directory
+bool lookupPath(const char *path, DirItem *found){
+    char          pathCopy[PATH_MAX];
+    char          *name;
+    unsigned long cluster = bpb.BPB_RootClus;
+    LookupState   state;
+
+    memset(found, 0, sizeof(DirItem));
+    found->entry.DIR_Attr      = 0x10;
+    found->entry.DIR_FstClusHI = cluster >> 16;
+    found->entry.DIR_FstClusLO = cluster & 0xFFFF;
+    found->dirPath             = "";
+
+    snprintf(pathCopy, PATH_MAX, "%s", path);
+    for(name = strtok(pathCopy, "/"); name != NULL; name = strtok(NULL, "/")){
+		if(!(found->entry.DIR_Attr & 0x10)){
+	    	return false;
+		}
+		state.name    = name;
+		state.found   = found;
+		state.matched = false;
+		walkDir(cluster, "", lookupCallback, &state, false);
+		if(!state.matched){
+	    	return false;
+		}
+		cluster = getNextCluster(found->entry);
+    }
+    return true;
+}
+
+// Copy the first size bytes of the chain starting at cluster to out and return how many were
+// copied, stopping early if a read or write fails. Clusters that follow each other on disk
+// are read together with a single fread
+unsigned long writeFileData(unsigned long cluster, unsigned long size, FILE *out){
+    unsigned long bytesPerCluster = sectorsPerCluster * 512;
+    unsigned long maxRun          = DATA_RUN_BYTES / bytesPerCluster;
+    unsigned char *dataBuffer;
+    unsigned long first, run, next, length;
+    unsigned long copied = 0;
+
+    if(maxRun == 0){
+		maxRun = 1;
+    }
+    dataBuffer = malloc(maxRun * bytesPerCluster);
+
+    while(copied < size && cluster >= 2 && cluster < 0x0FFFFFF7){
+		// find how many clusters of the chain are next to each other
+		first = cluster;
+		run   = 1;
+		next  = readFAT(cluster) & 0x0FFFFFFF;
+		while(next == first + run && run < maxRun && copied + run * bytesPerCluster < size){
+	    	run++;
+	    	next = readFAT(next) & 0x0FFFFFFF;
+		}
+
+		length = run * bytesPerCluster;
+		if(length > size - copied){
+	    	length = size - copied;
+		}
+		fseek(fileptr, (getFirstSector(first) + fatLBA) * 512, SEEK_SET);
+		if(fread(dataBuffer, length, 1, fileptr) != 1){
+	    	break;
+		}
+		if(fwrite(dataBuffer, 1, length, out) != length){
+	    	break;
+		}
+		copied += length;
+		cluster = next;
+    }
+
+    free(dataBuffer);
+    return copied;
+}
+
+// FAT dates and times are local time
+time_t fatToUnixTime(unsigned short date, unsigned short time){
+    struct tm fatTime;
+    int       year, month, day, hour, minute, second;
+
+    decodeDate(date, &year, &month, &day);
+    decodeTime(time, &hour, &minute, &second);
+    memset(&fatTime, 0, sizeof(fatTime));
+    fatTime.tm_year  = year - 1900;
+    fatTime.tm_mon   = month - 1;
+    fatTime.tm_mday  = day;
+    fatTime.tm_hour  = hour;
+    fatTime.tm_min   = minute;
+    fatTime.tm_sec   = second;
+    fatTime.tm_isdst = -1;
+    return mktime(&fatTime);
+}
+
+// Write a ustar header block. Names that do not fit the 100 byte name and 155 byte prefix
+// fields are written in a GNU long name block first
+void writeTarHeader(FILE *out, const char *name, unsigned long size, time_t mtime, char type){
+    unsigned char header[512];
+    size_t        nameLength = strlen(name);
+    size_t        split      = 0;
+    unsigned int  checkSum   = 0;
+    int           i;
+
+    memset(header, 0, sizeof(header));
+    if(nameLength > 100){
+		// look for a / that splits the name into prefix and name fields
+		for(i = nameLength - 1; i > 0 && split == 0; i--){
+	    	if(name[i] == '/' && i <= 155 && nameLength - i - 1 <= 100){
+				split = i;
+	    	}
+		}
+		if(split == 0){
+	    	unsigned char block[512];
+	    	size_t        written, length;
+
+	    	writeTarHeader(out, "././@LongLink", nameLength + 1, 0, 'L');
+	    	for(written = 0; written < nameLength + 1; written += 512){
+				length = nameLength - written < 512 ? nameLength - written : 512;
+				memset(block, 0, sizeof(block));
+				memcpy(block, name + written, length);
+				fwrite(block, 1, 512, out);
+	    	}
+		}
+    }
+
+    if(split > 0){
+		memcpy(header + 345, name, split);
+		memcpy(header, name + split + 1, nameLength - split - 1);
+    }else{
+		memcpy(header, name, nameLength < 100 ? nameLength : 100);
+    }
+    snprintf((char*)header + 100, 8, "%07o", type == '5' ? 0755 : 0644);
+    snprintf((char*)header + 108, 8, "%07o", 0);
+    snprintf((char*)header + 116, 8, "%07o", 0);
+    snprintf((char*)header + 124, 12, "%011lo", size);
+    snprintf((char*)header + 136, 12, "%011lo", (unsigned long)mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    // the checksum is taken with the checksum field filled with spaces
+    memset(header + 148, ' ', 8);
+    for(i = 0; i < 512; i++){
+		checkSum += header[i];
+    }
+    snprintf((char*)header + 148, 8, "%06o", checkSum);
+    header[155] = ' ';
+
+    fwrite(header, 1, 512, out);
+}
+
+// Collect the entries that go into the archive
+bool tarCallback(DirItem *item, void *context){
+    TarState *state = (TarState*)context;
+    TarItem  *tarItem;
+    char     path[PATH_MAX];
+    bool     isDir = (item->entry.DIR_Attr & 0x10) != 0;
+
+    if(state->useFilter && (isDir || !matchFilter(item, &state->filter))){
+		return true;
+    }
+
+    if(state->numItems == state->maxItems){
+		state->maxItems = state->maxItems == 0 ? 1024 : state->maxItems * 2;
+		state->items    = realloc(state->items, state->maxItems * sizeof(TarItem));
+    }
+
+    // archive names are relative, so drop the leading /
+    getItemPath(item, path);
+    tarItem          = &state->items[state->numItems];
+    tarItem->path    = strdup(path + 1);
+    tarItem->cluster = getNextCluster(item->entry);
+    tarItem->size    = isDir ? 0 : item->entry.DIR_FileSize;
+    tarItem->date    = item->entry.DIR_WrtDate;
+    tarItem->time    = item->entry.DIR_WrtTime;
+    tarItem->isDir   = isDir;
+    tarItem->order   = state->numItems;
+    state->numItems++;
+    return true;
+}
+
+// Directories first in tree order, then files by their first cluster so the
+// image is read from start to end
+int compareTarItems(const void *a, const void *b){
+    const TarItem *itemA = (const TarItem*)a;
+    const TarItem *itemB = (const TarItem*)b;
+
+    if(itemA->isDir != itemB->isDir){
+		return itemA->isDir ? -1 : 1;
+    }
+    if(!itemA->isDir && itemA->cluster != itemB->cluster){
+		return itemA->cluster < itemB->cluster ? -1 : 1;
+    }
+    return itemA->order - itemB->order;
+}
+
+// Pack the directory at dirPath into a tar archive at outName ("-" for stdout)
+// filterArgs are the FIND pattern and filters, if given only matching files are archived
+bool writeTar(char *outName, char *dirPath, char *filterArgs){
+    TarState      state;
+    DirItem       dir;
+    char          baseName[MAX_NAME_BYTES + 1] = "";
+    FILE          *out;
+    FILE          *messages = strcmp(outName, "-") == 0 ? stderr : stdout;
+    unsigned char zeros[1024];
+    unsigned long copied, totalSize = 0;
+    bool          failed;
+    int           i, numFiles = 0;
+
+    memset(&state, 0, sizeof(state));
+    if(!lookupPath(dirPath, &dir) || !(dir.entry.DIR_Attr & 0x10)){
+		fprintf(messages, "Directory not found: %s\n", dirPath);
+		return false;
+    }
+    state.useFilter = filterArgs[strspn(filterArgs, " ")] != '\0';
+    if(!parseFilter(filterArgs, &state.filter)){
+		return false;
+    }
+
+    // archive the directory under its own name, or its contents for the root
+    if(getNextCluster(dir.entry) != bpb.BPB_RootClus){
+		getSafeName(&dir, baseName + 1, sizeof(baseName) - 1);
+		baseName[0] = '/';
+		if(!state.useFilter){
+	    	tarCallback(&dir, &state);
+	    	free(state.items[0].path);
+	    	state.items[0].path = strdup(baseName + 1);
+		}
+    }
+    walkDir(getNextCluster(dir.entry), baseName, tarCallback, &state, true);
+    freeFilter(&state.filter);
+
+    qsort(state.items, state.numItems, sizeof(TarItem), compareTarItems);
+
+    if(strcmp(outName, "-") == 0){
+		out = stdout;
+    }else{
+		out = fopen(outName, "wb");
+		if(out == NULL){
+	    	fprintf(messages, "Could not open %s: %s\n", outName, strerror(errno));
+	    	return false;
+		}
+		setvbuf(out, NULL, _IOFBF, DATA_RUN_BYTES);
+    }
+    memset(zeros, 0, sizeof(zeros));
+
+    // stop at the first failed write, stdio keeps the error in ferror(out)
+    for(i = 0; i < state.numItems && !ferror(out); i++){
+		TarItem *item  = &state.items[i];
+		time_t  mtime  = fatToUnixTime(item->date, item->time);
+
+		if(item->isDir){
+	    	char dirName[PATH_MAX];
+
+	    	snprintf(dirName, PATH_MAX, "%s/", item->path);
+	    	writeTarHeader(out, dirName, 0, mtime, '5');
+		}else{
+	    	writeTarHeader(out, item->path, item->size, mtime, '0');
+	    	copied = writeFileData(item->cluster, item->size, out);
+
+	    	// keep the archive readable if the chain ends before the file size
+	    	while(copied < item->size && !ferror(out)){
+				unsigned long length = item->size - copied < sizeof(zeros) ?
+				                       item->size - copied : sizeof(zeros);
+				fwrite(zeros, 1, length, out);
+				copied += length;
+	    	}
+	    	fwrite(zeros, 1, (512 - item->size % 512) % 512, out);
+	    	totalSize += item->size;
+	    	numFiles++;
+		}
+    }
+    // the archive ends with two empty blocks
+    fwrite(zeros, 1, 1024, out);
+
+    failed = ferror(out);
+    if(out == stdout){
+		failed = fflush(out) != 0 || failed;
+    }else{
+		failed = fclose(out) != 0 || failed;
+    }
+    for(i = 0; i < state.numItems; i++){
+		free(state.items[i].path);
+    }
+    free(state.items);
+    if(failed){
+		fprintf(messages, "Could not write %s: %s\n", outName, strerror(errno));
+		return false;
+    }
+    fprintf(messages, "Archived %d files (%'lu bytes) to %s\n", numFiles, totalSize, outName);
+    return true;
+}
+
+// Add the reads for the first size bytes of the chain starting at cluster, clusters that are
+// next to each other on disk become one read of up to PLAN_MAX_READ bytes
+void planFile(IOPlan *plan, unsigned long cluster, unsigned long size, FILE *dest){
+    unsigned long bytesPerCluster = sectorsPerCluster * 512;
+    unsigned long offset          = 0;
+    unsigned long first, run, next, length;
+    IORead        *read;
+
+    while(offset < size && cluster >= 2 && cluster < 0x0FFFFFF7){
+		first = cluster;
+		run   = 1;
+		next  = readFAT(cluster) & 0x0FFFFFFF;
+		while(next == first + run && (run + 1) * bytesPerCluster <= PLAN_MAX_READ &&
+		      offset + run * bytesPerCluster < size){
+	    	run++;
+	    	next = readFAT(next) & 0x0FFFFFFF;
+		}
+
+		length = run * bytesPerCluster;
+		if(length > size - offset){
+	    	length = size - offset;
+		}
+
+		if(plan->numReads == plan->maxReads){
+	    	plan->maxReads = plan->maxReads == 0 ? 1024 : plan->maxReads * 2;
+	    	plan->reads    = realloc(plan->reads, plan->maxReads * sizeof(IORead));
+		}
+		read             = &plan->reads[plan->numReads];
+		read->lba        = getFirstSector(first) + fatLBA;
+		read->sectors    = (length + 511) / 512;
+		read->dest       = dest;
+		read->destOffset = offset;
+		read->length     = length;
+		read->failed     = false;
+		plan->numReads++;
+
+		offset += length;
+		cluster = next;
+    }
+}
+
+int compareIOReads(const void *a, const void *b){
+    const IORead *readA = (const IORead*)a;
+    const IORead *readB = (const IORead*)b;
+
+    if(readA->lba != readB->lba){
+		return readA->lba < readB->lba ? -1 : 1;
+    }
+    return 0;
+}
+
+// Sort the planned reads by LBA and merge reads that are at most gapSectors apart into one
+// fread of up to PLAN_MAX_READ bytes, then write each part to its own file and offset
+// If a merged read fails its parts are read one by one, parts that still fail are marked failed
+void runPlan(IOPlan *plan){
+    unsigned char *readBuffer = malloc(PLAN_MAX_READ);
+    unsigned char *data;
+    unsigned long start, end;
+    IORead        *read;
+    bool          merged;
+    int           i, j, k;
+
+    qsort(plan->reads, plan->numReads, sizeof(IORead), compareIOReads);
+    plan->numMerged = 0;
+
+    for(i = 0; i < plan->numReads; i = j){
+		start = plan->reads[i].lba;
+		end   = start + plan->reads[i].sectors;
+
+		// take in the following reads while the gap and total size stay small enough
+		for(j = i + 1; j < plan->numReads; j++){
+	    	if(plan->reads[j].lba > end + plan->gapSectors ||
+	       	   (plan->reads[j].lba + plan->reads[j].sectors - start) * 512 > PLAN_MAX_READ){
+				break;
+	    	}
+	    	if(plan->reads[j].lba + plan->reads[j].sectors > end){
+				end = plan->reads[j].lba + plan->reads[j].sectors;
+	    	}
+		}
+
+		fseek(fileptr, start * 512, SEEK_SET);
+		merged = fread(readBuffer, (end - start) * 512, 1, fileptr) == 1;
+		plan->numMerged++;
+
+		// scatter the data back to the files
+		for(k = i; k < j; k++){
+	    	read = &plan->reads[k];
+	    	data = readBuffer + (read->lba - start) * 512;
+	    	if(!merged){
+				// fall back to reading just this part, e.g. when the span runs past the end
+				fseek(fileptr, read->lba * 512, SEEK_SET);
+				data = readBuffer;
+				plan->numMerged++;
+				if(fread(data, read->length, 1, fileptr) != 1){
+		    		read->failed = true;
+		    		continue;
+				}
+	    	}
+	    	fseek(read->dest, read->destOffset, SEEK_SET);
+	    	if(fwrite(data, 1, read->length, read->dest) != read->length){
+				read->failed = true;
+	    	}
+		}
+    }
+
+    free(readBuffer);
+}
+
+// Create or truncate path for writing, a symlink in its place is not followed
+FILE* createFile(const char *path){
+    FILE *out;
+    int  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+
+    if(fd < 0){
+		return NULL;
+    }
+    out = fdopen(fd, "wb");
+    if(out == NULL){
+		close(fd);
+    }
+    return out;
+}
+
+// mkdir -p, path is changed while working but put back
+bool makeDirs(char *path){
+    char *slash;
+
+    for(slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')){
+		*slash = '\0';
+		if(mkdir(path, 0755) != 0 && errno != EEXIST){
+	    	*slash = '/';
+	    	return false;
+		}
+		*slash = '/';
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// Extract every file passing the filters into outDir, keeping the directory tree
+// Files are taken PLAN_MAX_FILES at a time in first cluster order and each batch is read
+// through an IOPlan, so the image is read in large mostly sequential pieces
+bool extractAll(char *outDir, unsigned long gapClusters, char *filterArgs){
+    TarState      state;
+    IOPlan        plan;
+    FILE          *files[PLAN_MAX_FILES];
+    bool          failed[PLAN_MAX_FILES];
+    char          path[PATH_MAX];
+    char          *slash;
+    unsigned long totalSize = 0;
+    int           numFiles = 0, numFailed = 0, numRuns = 0, numReads = 0;
+    int           i, k, batchStart, batchFiles;
+
+    memset(&state, 0, sizeof(state));
+    memset(&plan, 0, sizeof(plan));
+    plan.gapSectors = gapClusters * sectorsPerCluster;
+
+    // the TAR collection gives the files in first cluster order with directories first
+    state.useFilter = filterArgs[strspn(filterArgs, " ")] != '\0';
+    if(!parseFilter(filterArgs, &state.filter)){
+		return false;
+    }
+    walkDir(bpb.BPB_RootClus, "", tarCallback, &state, true);
+    freeFilter(&state.filter);
+    qsort(state.items, state.numItems, sizeof(TarItem), compareTarItems);
+
+    if(!makeDirs(outDir)){
+		printf("Could not create %s: %s\n", outDir, strerror(errno));
+		state.numItems = 0;
+    }
+
+    for(i = 0; i < state.numItems && state.items[i].isDir; i++){
+		snprintf(path, PATH_MAX, "%s/%s", outDir, state.items[i].path);
+		makeDirs(path);
+    }
+
+    for(batchStart = i; batchStart < state.numItems; batchStart += batchFiles){
+		batchFiles    = 0;
+		plan.numReads = 0;
+
+		for(i = batchStart; i < state.numItems && batchFiles < PLAN_MAX_FILES; i++){
+	    	snprintf(path, PATH_MAX, "%s/%s", outDir, state.items[i].path);
+	    	slash = strrchr(path, '/');
+	    	*slash = '\0';
+	    	makeDirs(path);
+	    	*slash = '/';
+
+	    	files[batchFiles]  = createFile(path);
+	    	failed[batchFiles] = files[batchFiles] == NULL;
+	    	if(files[batchFiles] == NULL){
+				printf("Could not create %s: %s\n", path, strerror(errno));
+	    	}else{
+				planFile(&plan, state.items[i].cluster, state.items[i].size, files[batchFiles]);
+	    	}
+	    	batchFiles++;
+		}
+
+		runPlan(&plan);
+		numRuns  += plan.numReads;
+		numReads += plan.numMerged;
+
+		// a file is only counted when every one of its reads made it to disk
+		for(k = 0; k < plan.numReads; k++){
+	    	if(plan.reads[k].failed){
+				for(i = 0; files[i] != plan.reads[k].dest; i++);
+				failed[i] = true;
+	    	}
+		}
+
+		for(i = 0; i < batchFiles; i++){
+	    	if(files[i] == NULL){
+				continue;
+	    	}
+	    	if(fclose(files[i]) != 0){
+				failed[i] = true;
+	    	}
+	    	if(failed[i]){
+				printf("Could not read /%s\n", state.items[batchStart + i].path);
+				numFailed++;
+	    	}else{
+				totalSize += state.items[batchStart + i].size;
+				numFiles++;
+	    	}
+		}
+    }
+
+    for(i = 0; i < state.numItems; i++){
+		free(state.items[i].path);
+    }
+    free(state.items);
+    free(plan.reads);
+    printf("Extracted %d files (%'lu bytes) to %s: %d cluster runs in %d reads\n",
+	       numFiles, totalSize, outDir, numRuns, numReads);
+    if(numFailed > 0){
+		printf("%d files could not be read\n", numFailed);
+    }
+    return true;
+}
+
+// Read one directory cluster into data, keeping a copy in dirCache for the next time
+bool readDirCluster(unsigned long cluster, unsigned char *data){
+    unsigned long bytesPerCluster = sectorsPerCluster * 512;
+    DirCacheSlot  *slot;
+
+    if(dirCache == NULL){
+		dirCache = calloc(DIR_CACHE_SLOTS, sizeof(DirCacheSlot));
+    }
+    slot = &dirCache[cluster % DIR_CACHE_SLOTS];
+    if(slot->cluster == cluster){
+		memcpy(data, slot->data, bytesPerCluster);
+		return true;
+    }
+
+    fseek(fileptr, (getFirstSector(cluster) + fatLBA) * 512, SEEK_SET);
+    if(fread(data, bytesPerCluster, 1, fileptr) != 1){
+		return false;
+    }
+    if(slot->data == NULL){
+		slot->data = malloc(bytesPerCluster);
+    }
+    memcpy(slot->data, data, bytesPerCluster);
+    slot->cluster = cluster;
+    return true;
+}
+
+// Make volume the image the rest of the program works on
+void useVolume(Volume *volume){
+    fileptr           = volume->fileptr;
+    fatLBA            = volume->fatLBA;
+    sectorsPerCluster = volume->sectorsPerCluster;
+    reservedSectors   = volume->reservedSectors;
+    sectorsPerFAT     = volume->sectorsPerFAT;
+    dataSectorStart   = volume->dataSectorStart;
+    mbr               = volume->mbr;
+    bpb               = volume->bpb;
+    fatTable          = volume->fatTable;
+    numFATEntries     = volume->numFATEntries;
+    dirCache          = volume->dirCache;
+}
+
+// Keep the current image's globals, including caches filled since useVolume
+void saveVolume(Volume *volume){
+    volume->fileptr           = fileptr;
+    volume->fatLBA            = fatLBA;
+    volume->sectorsPerCluster = sectorsPerCluster;
+    volume->reservedSectors   = reservedSectors;
+    volume->sectorsPerFAT     = sectorsPerFAT;
+    volume->dataSectorStart   = dataSectorStart;
+    volume->mbr               = mbr;
+    volume->bpb               = bpb;
+    volume->fatTable          = fatTable;
+    volume->numFATEntries     = numFATEntries;
+    volume->dirCache          = dirCache;
+}
+
+// Append up to length bytes of a file starting at offset to out, returns how many
+unsigned long readFileRange(unsigned long cluster, unsigned long size, unsigned long offset,
+			                unsigned long length, ByteBuffer *out){
+    unsigned long bytesPerCluster = sectorsPerCluster * 512;
+    unsigned long skip, start, count;
+    unsigned long copied = 0;
+
+    if(offset >= size){
+		return 0;
+    }
+    if(length > size - offset){
+		length = size - offset;
+    }
+
+    // follow the chain in memory to the cluster holding offset
+    for(skip = offset / bytesPerCluster; skip > 0 && cluster >= 2 && cluster < 0x0FFFFFF7; skip--){
+		cluster = readFAT(cluster) & 0x0FFFFFFF;
+    }
+
+    if(out->used + length > out->size){
+		unsigned char *data = realloc(out->data, out->used + length);
+
+		if(data == NULL){
+	    	out->failed = true;
+	    	return 0;
+		}
+		out->data = data;
+		out->size = out->used + length;
+    }
+    start = offset % bytesPerCluster;
+    while(copied < length && cluster >= 2 && cluster < 0x0FFFFFF7){
+		count = bytesPerCluster - start;
+		if(count > length - copied){
+	    	count = length - copied;
+		}
+		fseek(fileptr, (getFirstSector(cluster) + fatLBA) * 512 + start, SEEK_SET);
+		if(fread(out->data + out->used, count, 1, fileptr) != 1){
+	    	break;
+		}
+		out->used += count;
+		copied    += count;
+		start      = 0;
+		cluster    = readFAT(cluster) & 0x0FFFFFFF;
+    }
+    return copied;
+}
+
+// Append attr, size, first cluster, last write time and name separated by tabs
+void appendEntryLine(ByteBuffer *out, DIR *entry, const char *name){
+    char line[64];
+
+    snprintf(line, sizeof(line), "%02X\t%u\t%lu\t", entry->DIR_Attr, entry->DIR_FileSize,
+	         getNextCluster(*entry));
+    appendBytes(out, line, strlen(line));
+    if(entry->DIR_WrtDate == 0){
+		appendBytes(out, "-", 1);
+    }else{
+		appendTimestamp(out, entry->DIR_WrtDate, entry->DIR_WrtTime, -1, true);
+    }
+    appendBytes(out, "\t", 1);
+    appendBytes(out, name, strlen(name));
+    appendBytes(out, "\n", 1);
+}
+
+bool listCallback(DirItem *item, void *context){
+    char name[MAX_NAME_BYTES];
+
+    getLongName(item, name, sizeof(name));
+    appendEntryLine((ByteBuffer*)context, &item->entry, name);
+    return true;
+}
+
+// Answer one request line. Requests are
+//     IMAGES
+//     LIST <image> <path>
+//     STAT <image> <path>
+//     READ <image> <path> <offset> <length>
+//     EXTRACT <image> <path> <output file>
+// where <image> is the number of the image from IMAGES and paths with spaces are quoted.
+// EXTRACT writes <output file> into extractDir and is refused when there is none.
+// The response is "OK <length>\n" and <length> bytes, or "ERR <message>\n"
+void serveRequest(char *request, Volume *volumes, int numVolumes, const char *extractDir,
+				  ByteBuffer *response){
+    ByteBuffer  payload = {NULL, 0, 0, false};
+    const char  *error  = NULL;
+    char        *args   = request;
+    char        *verb   = nextToken(&args);
+    char        *number = NULL;
+    char        *path   = NULL;
+    char        *end    = NULL;
+    char        header[64];
+    DirItem     item;
+    long        index = -1;
+    int         i;
+
+    if(verb != NULL && strcmp(verb, "IMAGES") != 0){
+		number = nextToken(&args);
+		path   = nextToken(&args);
+		if(number != NULL){
+	    	// a missing, signed or trailing-garbage id is an unknown image, not image 0
+	    	errno = 0;
+	    	index = number[0] >= '0' && number[0] <= '9' ? strtol(number, &end, 10) : -1;
+	    	if(index >= 0 && (*end != '\0' || errno == ERANGE)){
+				index = -1;
+	    	}
+		}
+    }
+
+    if(verb == NULL){
+		error = "empty request";
+    }else if(strcmp(verb, "IMAGES") == 0){
+		for(i = 0; i < numVolumes; i++){
+	    	snprintf(header, sizeof(header), "%d\t", i);
+	    	appendBytes(&payload, header, strlen(header));
+	    	appendBytes(&payload, volumes[i].path, strlen(volumes[i].path));
+	    	appendBytes(&payload, "\n", 1);
+		}
+    }else if(number == NULL || index < 0 || index >= numVolumes){
+		error = "unknown image";
+    }else if(path == NULL){
+		error = "missing path";
+    }else{
+		useVolume(&volumes[index]);
+
+		if(!lookupPath(path, &item)){
+	    	error = "not found";
+		}else if(strcmp(verb, "LIST") == 0){
+	    	if(!(item.entry.DIR_Attr & 0x10)){
+				error = "not a directory";
+	    	}else{
+				walkDir(getNextCluster(item.entry), "", listCallback, &payload, false);
+	    	}
+		}else if(strcmp(verb, "STAT") == 0){
+	    	appendEntryLine(&payload, &item.entry, path);
+		}else if(strcmp(verb, "READ") == 0){
+	    	char          *offset = nextToken(&args);
+	    	char          *length = nextToken(&args);
+	    	unsigned long count   = length == NULL ? 0 : strtoul(length, NULL, 10);
+
+	    	if(offset == NULL || length == NULL){
+				error = "usage: READ <image> <path> <offset> <length>";
+	    	}else if(item.entry.DIR_Attr & 0x10){
+				error = "not a file";
+	    	}else{
+				readFileRange(getNextCluster(item.entry), item.entry.DIR_FileSize,
+				              strtoul(offset, NULL, 10),
+				              count < SERVE_MAX_READ ? count : SERVE_MAX_READ, &payload);
+	    	}
+		}else if(strcmp(verb, "EXTRACT") == 0){
+	    	char *outName = nextToken(&args);
+	    	char outPath[PATH_MAX];
+	    	FILE *out = NULL;
+	    	int  fd;
+
+	    	if(outName == NULL){
+				error = "usage: EXTRACT <image> <path> <output file>";
+	    	}else if(extractDir == NULL){
+				error = "EXTRACT needs the server started with --extract-dir";
+	    	}else if(outName[0] == '\0' || strchr(outName, '/') != NULL ||
+	    	         strcmp(outName, ".") == 0 || strcmp(outName, "..") == 0){
+				// only plain file names, so the output stays inside extractDir
+				error = "output file must be a file name without '/'";
+	    	}else if(item.entry.DIR_Attr & 0x10){
+				error = "not a file";
+	    	}else{
+				// do not follow a symlink someone left in extractDir
+				snprintf(outPath, sizeof(outPath), "%s/%s", extractDir, outName);
+				fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+				if(fd < 0 || (out = fdopen(fd, "wb")) == NULL){
+		    		error = strerror(errno);
+		    		if(fd >= 0){
+						close(fd);
+		    		}
+				}else{
+		    		writeFileData(getNextCluster(item.entry), item.entry.DIR_FileSize, out);
+		    		fclose(out);
+				}
+	    	}
+		}else{
+	    	error = "unknown request";
+		}
+
+		// keep the FAT and directory clusters read for this request for the next ones
+		saveVolume(&volumes[index]);
+    }
+
+    if(error == NULL && payload.failed){
+		error = "out of memory";
+    }
+    if(error != NULL){
+		snprintf(header, sizeof(header), "ERR %s\n", error);
+		appendBytes(response, header, strlen(header));
+    }else{
+		snprintf(header, sizeof(header), "OK %zu\n", payload.used);
+		appendBytes(response, header, strlen(header));
+		appendBytes(response, payload.data, payload.used);
+    }
+    free(payload.data);
+}
+
+// Send as much of the client's pending response as the socket takes without blocking, then
+// answer the next complete request line once nothing is pending. Returns false when the
+// client should be closed
+bool serveClient(Client *client, Volume *volumes, int numVolumes, const char *extractDir){
+    ssize_t count;
+    char    *newline;
+
+    while(true){
+		while(client->sent < client->pending.used){
+	    	count = write(client->fd, client->pending.data + client->sent,
+	                      client->pending.used - client->sent);
+	    	if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				return true;
+	    	}
+	    	if(count <= 0){
+				return false;
+	    	}
+	    	client->sent += count;
+		}
+		client->pending.used = 0;
+		client->sent         = 0;
+		// do not hold on to the buffer of a large READ while the client is idle
+		if(client->pending.size > SERVE_MAX_READ / 64){
+	    	free(client->pending.data);
+	    	client->pending.data = NULL;
+	    	client->pending.size = 0;
+		}
+
+		if(client->closing){
+	    	return false;
+		}
+		newline = strchr(client->line, '\n');
+		if(newline == NULL){
+	    	if(client->used < sizeof(client->line) - 1){
+				return true;
+	    	}
+	    	// a request that does not fit the line buffer is not answered
+	    	appendBytes(&client->pending, "ERR request too long\n", 21);
+	    	client->closing = true;
+	    	continue;
+		}
+
+		*newline = '\0';
+		if(newline > client->line && *(newline - 1) == '\r'){
+	    	*(newline - 1) = '\0';
+		}
+		serveRequest(client->line, volumes, numVolumes, extractDir, &client->pending);
+
+		client->used -= newline + 1 - client->line;
+		memmove(client->line, newline + 1, client->used + 1);
+    }
+}
+
+// Keep the images open and answer requests on a Unix domain socket until killed
+// Clients are handled in one poll loop with non-blocking sockets, so requests run one at a
+// time and all share each image's FAT and directory cache, and a client that does not read
+// its responses only holds up itself
+bool serve(const char *socketPath, const char *extractDir, char *imagePaths[], int numImages){
+    Volume             *volumes = calloc(numImages, sizeof(Volume));
+    Client             clients[SERVE_MAX_CLIENTS];
+    struct pollfd      fds[SERVE_MAX_CLIENTS + 1];
+    struct sockaddr_un address;
+    int                listener, numClients = 0;
+    int                i;
+    ssize_t            count;
+    bool               keep;
+
+    for(i = 0; i < numImages; i++){
+		if(!openImage(imagePaths[i])){
+	    	return false;
+		}
+		// load the FAT now so the first request does not pay for it
+		loadFAT();
+		volumes[i].path = imagePaths[i];
+		saveVolume(&volumes[i]);
+    }
+
+    // a client going away in the middle of a response should not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    unlink(socketPath);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+       listen(listener, SERVE_MAX_CLIENTS) != 0){
+		fprintf(stderr, "Could not listen on %s: %s\n", socketPath, strerror(errno));
+		return false;
+    }
+    printf("Serving %d image(s) on %s\n", numImages, socketPath);
+    fflush(stdout);
+
+    while(true){
+		fds[0].fd     = listener;
+		fds[0].events = numClients < SERVE_MAX_CLIENTS ? POLLIN : 0;
+		for(i = 0; i < numClients; i++){
+	    	// wait for room to send while a response is pending, else for the next request
+	    	fds[i + 1].fd     = clients[i].fd;
+	    	fds[i + 1].events = clients[i].sent < clients[i].pending.used ? POLLOUT : POLLIN;
+		}
+		if(poll(fds, numClients + 1, -1) < 0){
+	    	if(errno == EINTR){
+				continue;
+	    	}
+	    	break;
+		}
+
+		// go through the clients from the back so closed ones can be swapped out
+		for(i = numClients - 1; i >= 0; i--){
+	    	if(fds[i + 1].revents == 0){
+				continue;
+	    	}
+
+	    	keep = true;
+	    	if(fds[i + 1].events == POLLIN){
+				count = read(clients[i].fd, clients[i].line + clients[i].used,
+		                     sizeof(clients[i].line) - clients[i].used - 1);
+				if(count > 0){
+		    		clients[i].used += count;
+		    		clients[i].line[clients[i].used] = '\0';
+				}else if(count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+		    		keep = false;
+				}
+	    	}
+	    	if(keep){
+				keep = serveClient(&clients[i], volumes, numImages, extractDir);
+	    	}
+	    	if(keep){
+				continue;
+	    	}
+
+	    	close(clients[i].fd);
+	    	free(clients[i].pending.data);
+	    	numClients--;
+	    	clients[i] = clients[numClients];
+		}
+
+		if(fds[0].revents & POLLIN){
+	    	int fd = accept(listener, NULL, NULL);
+	    	if(fd >= 0){
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				memset(&clients[numClients], 0, sizeof(Client));
+				clients[numClients].fd = fd;
+				numClients++;
+	    	}
+		}
+    }
+
+    close(listener);
+    unlink(socketPath);
+    return false;
+}
+
+// FNV-1a, start with FNV_OFFSET or the hash of the data before
+unsigned long long hashBytes(const unsigned char *data, size_t n, unsigned long long hash){
+    size_t i;
+
+    for(i = 0; i < n; i++){
+		hash ^= data[i];
+		hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Hash every cluster of a directory, the clusters stay in dirCache for walkDir
+unsigned long long hashDir(unsigned long cluster){
+    unsigned long      bytesPerCluster = sectorsPerCluster * 512;
+    unsigned long      maxClusters     = DIR_MAX_ENTRIES * 32 / bytesPerCluster + 1;
+    unsigned char      *data           = malloc(bytesPerCluster);
+    unsigned long      *chain          = malloc(maxClusters * sizeof(unsigned long));
+    unsigned long long hash            = FNV_OFFSET;
+    unsigned long      steps;
+
+    // stop where walkDir stops, so a looping chain ends
+    for(steps = 0; cluster >= 2 && cluster < 0x0FFFFFF7 && steps < maxClusters &&
+	               !clusterSeen(chain, steps, cluster) && readDirCluster(cluster, data); steps++){
+		chain[steps] = cluster;
+		hash         = hashBytes(data, bytesPerCluster, hash);
+		cluster      = readFAT(cluster) & 0x0FFFFFFF;
+    }
+    free(data);
+    free(chain);
+    return hash;
+}
+
+// Hash the cluster numbers along a chain, so a file whose clusters changed gets a new hash
+// even when its directory entry did not. End of chain markers all hash the same
+unsigned long long hashChain(unsigned long cluster){
+    unsigned long long hash = FNV_OFFSET;
+    unsigned long      steps;
+    unsigned int       number;
+
+    // the step limit stops at loops in a damaged FAT
+    for(steps = 0; cluster >= 2 && cluster < 0x0FFFFFF7 && steps < numFATEntries; steps++){
+		number  = cluster;
+		hash    = hashBytes((unsigned char*)&number, 4, hash);
+		cluster = readFAT(cluster) & 0x0FFFFFFF;
+    }
+    return hash;
+}
+
+SnapEntry* addSnapEntry(Snapshot *snap, const char *name, const char *path){
+    SnapEntry *entry;
+
+    if(snap->numEntries == snap->maxEntries){
+		snap->maxEntries = snap->maxEntries == 0 ? 1024 : snap->maxEntries * 2;
+		snap->entries    = realloc(snap->entries, snap->maxEntries * sizeof(SnapEntry));
+    }
+    entry       = &snap->entries[snap->numEntries];
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    snap->numEntries++;
+    return entry;
+}
+
+bool snapCallback(DirItem *item, void *context){
+    SnapBuild *build = (SnapBuild*)context;
+    SnapEntry *entry;
+    char      name[MAX_NAME_BYTES];
+    char      path[PATH_MAX];
+
+    getLongName(item, name, sizeof(name));
+    snprintf(path, PATH_MAX, "%s/%s", build->path, name);
+    entry          = addSnapEntry(build->snap, name, path);
+    entry->cluster = getNextCluster(item->entry);
+    entry->size    = item->entry.DIR_FileSize;
+    entry->wrtDate = item->entry.DIR_WrtDate;
+    entry->wrtTime = item->entry.DIR_WrtTime;
+    entry->attr    = item->entry.DIR_Attr;
+    entry->chainHash = (entry->attr & 0x10) ? 0 : hashChain(entry->cluster);
+    return true;
+}
+
+int compareSnapDirs(const void *a, const void *b){
+    const SnapDir *dirA = (const SnapDir*)a;
+    const SnapDir *dirB = (const SnapDir*)b;
+
+    if(dirA->cluster != dirB->cluster){
+		return dirA->cluster < dirB->cluster ? -1 : 1;
+    }
+    return 0;
+}
+
+int compareSnapPaths(const void *a, const void *b){
+    return strcmp((*(SnapEntry**)a)->path, (*(SnapEntry**)b)->path);
+}
+
+int compareSnapClusters(const void *a, const void *b){
+    const SnapEntry *entryA = *(SnapEntry**)a;
+    const SnapEntry *entryB = *(SnapEntry**)b;
+
+    if(entryA->cluster != entryB->cluster){
+		return entryA->cluster < entryB->cluster ? -1 : 1;
+    }
+    return 0;
+}
+
+// Record the directory at cluster and everything below it. If old has a directory at the
+// same cluster with the same hash its entries are copied instead of decoding the clusters,
+// and only the chains that go through a changed FAT block are hashed again
+void snapshotDir(Snapshot *snap, Snapshot *old, unsigned long cluster, const char *path){
+    SnapDir   key;
+    SnapDir   *oldDir = NULL;
+    SnapBuild build;
+    char      entryPath[PATH_MAX];
+    int       dirIndex, first, i;
+
+    key.cluster = cluster;
+    key.hash    = hashDir(cluster);
+    if(old != NULL){
+		oldDir = bsearch(&key, old->dirs, old->numDirs, sizeof(SnapDir), compareSnapDirs);
+    }
+
+    first = snap->numEntries;
+    if(oldDir != NULL && oldDir->hash == key.hash){
+		// unchanged, only the path can differ if a parent directory was renamed
+		for(i = oldDir->firstEntry; i < oldDir->firstEntry + oldDir->numEntries; i++){
+	    	SnapEntry *entry = &old->entries[i];
+	    	SnapEntry *copy;
+
+	    	snprintf(entryPath, PATH_MAX, "%s/%s", path, entry->name);
+	    	copy          = addSnapEntry(snap, entry->name, entryPath);
+	    	copy->cluster = entry->cluster;
+	    	copy->size    = entry->size;
+	    	copy->wrtDate = entry->wrtDate;
+	    	copy->wrtTime = entry->wrtTime;
+	    	copy->attr    = entry->attr;
+	    	copy->chainHash = entry->chainHash;
+	    	if(!(copy->attr & 0x10) &&
+	       	   chainChanged(copy->cluster, snap->changedBlocks, snap->numBlocks)){
+				copy->chainHash = hashChain(copy->cluster);
+	    	}
+		}
+    }else{
+		build.snap = snap;
+		build.path = path;
+		walkDir(cluster, path, snapCallback, &build, false);
+		snap->numDecoded++;
+    }
+
+    if(snap->numDirs == snap->maxDirs){
+		snap->maxDirs = snap->maxDirs == 0 ? 256 : snap->maxDirs * 2;
+		snap->dirs    = realloc(snap->dirs, snap->maxDirs * sizeof(SnapDir));
+    }
+    dirIndex                        = snap->numDirs;
+    snap->dirs[dirIndex]            = key;
+    snap->dirs[dirIndex].firstEntry = first;
+    snap->dirs[dirIndex].numEntries = snap->numEntries - first;
+    snap->numDirs++;
+
+    // entries can move while recursing, so go by index and copy the path. Like walkDir,
+    // do not go deeper than WALK_MAX_DEPTH or back into a directory above this one
+    if(!enterDir(cluster)){
+		return;
+    }
+    for(i = first; i < snap->dirs[dirIndex].firstEntry + snap->dirs[dirIndex].numEntries; i++){
+		if((snap->entries[i].attr & 0x10) && !dirOnStack(snap->entries[i].cluster)){
+	    	snprintf(entryPath, PATH_MAX, "%s", snap->entries[i].path);
+	    	snapshotDir(snap, old, snap->entries[i].cluster, entryPath);
+		}
+    }
+    leaveDir();
+}
+
+// Hash the FAT in FAT_HASH_ENTRIES blocks and record every directory of the current image
+// old, if given, must have its dirs sorted by cluster (see compareSnapDirs), the blocks
+// that differ from it are marked in changedBlocks
+void buildSnapshot(Snapshot *snap, Snapshot *old){
+    unsigned long block, count;
+
+    if(fatTable == NULL){
+		loadFAT();
+    }
+    snap->numBlocks   = (numFATEntries + FAT_HASH_ENTRIES - 1) / FAT_HASH_ENTRIES;
+    snap->blockHashes = malloc(snap->numBlocks * sizeof(unsigned long long));
+    for(block = 0; block < snap->numBlocks; block++){
+		count = numFATEntries - block * FAT_HASH_ENTRIES;
+		if(count > FAT_HASH_ENTRIES){
+	    	count = FAT_HASH_ENTRIES;
+		}
+		snap->blockHashes[block] = hashBytes((unsigned char*)(fatTable + block * FAT_HASH_ENTRIES),
+						                     count * 4, FNV_OFFSET);
+    }
+
+    snap->changedBlocks = calloc(snap->numBlocks + 1, sizeof(bool));
+    for(block = 0; old != NULL && block < snap->numBlocks; block++){
+		snap->changedBlocks[block] = block >= old->numBlocks ||
+		                             old->blockHashes[block] != snap->blockHashes[block];
+    }
+
+    snapshotDir(snap, old, bpb.BPB_RootClus, "");
+    qsort(snap->dirs, snap->numDirs, sizeof(SnapDir), compareSnapDirs);
+}
+
+void freeSnapshot(Snapshot *snap){
+    int i;
+
+    for(i = 0; i < snap->numEntries; i++){
+		free(snap->entries[i].name);
+		free(snap->entries[i].path);
+    }
+    free(snap->entries);
+    free(snap->dirs);
+    free(snap->blockHashes);
+    free(snap->changedBlocks);
+    memset(snap, 0, sizeof(Snapshot));
+}
+
+// Snapshot file: "F32SNAP2", the block count and block hashes, the directory count and
+// directories (cluster, hash, first entry, entry count), then the entry count and entries
+// (cluster, size, write date, write time, attributes, chain hash, then name and path each
+// as a 16-bit length and the bytes). Numbers are in host byte order
+bool saveSnapshot(Snapshot *snap, const char *fileName){
+    FILE           *out = fopen(fileName, "wb");
+    unsigned int   number;
+    unsigned short length;
+    int            i;
+
+    if(out == NULL){
+		printf("Could not open %s: %s\n", fileName, strerror(errno));
+		return false;
+    }
+    setvbuf(out, NULL, _IOFBF, DATA_RUN_BYTES);
+
+    fwrite("F32SNAP2", 1, 8, out);
+    number = snap->numBlocks;
+    fwrite(&number, 4, 1, out);
+    fwrite(snap->blockHashes, 8, snap->numBlocks, out);
+
+    fwrite(&snap->numDirs, 4, 1, out);
+    for(i = 0; i < snap->numDirs; i++){
+		number = snap->dirs[i].cluster;
+		fwrite(&number, 4, 1, out);
+		fwrite(&snap->dirs[i].hash, 8, 1, out);
+		fwrite(&snap->dirs[i].firstEntry, 4, 1, out);
+		fwrite(&snap->dirs[i].numEntries, 4, 1, out);
+    }
+
+    fwrite(&snap->numEntries, 4, 1, out);
+    for(i = 0; i < snap->numEntries; i++){
+		number = snap->entries[i].cluster;
+		fwrite(&number, 4, 1, out);
+		fwrite(&snap->entries[i].size, 4, 1, out);
+		fwrite(&snap->entries[i].wrtDate, 2, 1, out);
+		fwrite(&snap->entries[i].wrtTime, 2, 1, out);
+		fwrite(&snap->entries[i].attr, 1, 1, out);
+		fwrite(&snap->entries[i].chainHash, 8, 1, out);
+		length = strlen(snap->entries[i].name);
+		fwrite(&length, 2, 1, out);
+		fwrite(snap->entries[i].name, 1, length, out);
+		length = strlen(snap->entries[i].path);
+		fwrite(&length, 2, 1, out);
+		fwrite(snap->entries[i].path, 1, length, out);
+    }
+
+    return fclose(out) == 0;
+}
+
+// Read a snapshot written by saveSnapshot, in is just past the 8 byte magic
+bool loadSnapshot(Snapshot *snap, FILE *in){
+    unsigned int   number;
+    unsigned short length;
+    char           name[PATH_MAX];
+    char           path[PATH_MAX];
+    SnapEntry      *entry;
+    int            i, numEntries;
+    bool           ok;
+
+    memset(snap, 0, sizeof(Snapshot));
+    ok = fread(&number, 4, 1, in) == 1;
+    snap->numBlocks   = ok ? number : 0;
+    snap->blockHashes = malloc(snap->numBlocks * sizeof(unsigned long long) + 1);
+    ok = ok && fread(snap->blockHashes, 8, snap->numBlocks, in) == snap->numBlocks;
+
+    ok = ok && fread(&snap->numDirs, 4, 1, in) == 1 && snap->numDirs >= 0;
+    snap->maxDirs = ok ? snap->numDirs : 0;
+    snap->dirs    = malloc(snap->maxDirs * sizeof(SnapDir) + 1);
+    for(i = 0; ok && i < snap->numDirs; i++){
+		ok = fread(&number, 4, 1, in) == 1 &&
+		     fread(&snap->dirs[i].hash, 8, 1, in) == 1 &&
+		     fread(&snap->dirs[i].firstEntry, 4, 1, in) == 1 &&
+		     fread(&snap->dirs[i].numEntries, 4, 1, in) == 1;
+		snap->dirs[i].cluster = number;
+    }
+
+    ok = ok && fread(&numEntries, 4, 1, in) == 1;
+    for(i = 0; ok && i < numEntries; i++){
+		unsigned int   cluster, size;
+		unsigned short wrtDate, wrtTime;
+		unsigned char  attr;
+		unsigned long long chainHash;
+
+		ok = fread(&cluster, 4, 1, in) == 1 && fread(&size, 4, 1, in) == 1 &&
+		     fread(&wrtDate, 2, 1, in) == 1 && fread(&wrtTime, 2, 1, in) == 1 &&
+		     fread(&attr, 1, 1, in) == 1 && fread(&chainHash, 8, 1, in) == 1 &&
+		     fread(&length, 2, 1, in) == 1 && length < PATH_MAX && fread(name, 1, length, in) == length;
+		name[ok ? length : 0] = '\0';
+		ok = ok && fread(&length, 2, 1, in) == 1 && length < PATH_MAX && fread(path, 1, length, in) == length;
+		path[ok ? length : 0] = '\0';
+
+		if(ok){
+	    	entry          = addSnapEntry(snap, name, path);
+	    	entry->cluster = cluster;
+	    	entry->size    = size;
+	    	entry->wrtDate = wrtDate;
+	    	entry->wrtTime = wrtTime;
+	    	entry->attr    = attr;
+	    	entry->chainHash = chainHash;
+		}
+    }
+
+    // the directories must point inside the entries
+    for(i = 0; ok && i < snap->numDirs; i++){
+		ok = snap->dirs[i].firstEntry >= 0 && snap->dirs[i].numEntries >= 0 &&
+		     snap->dirs[i].firstEntry + snap->dirs[i].numEntries <= snap->numEntries;
+    }
+    if(!ok){
+		freeSnapshot(snap);
+    }
+    return ok;
+}
+
+// Does any cluster of the chain have its FAT entry in a changed block? If not the chain has
+// the same clusters as before and its old hash can be kept
+bool chainChanged(unsigned long cluster, bool *changedBlocks, unsigned long numBlocks){
+    unsigned long steps;
+
+    // the step limit stops at loops in a damaged FAT
+    for(steps = 0; cluster >= 2 && cluster < 0x0FFFFFF7 && steps < numFATEntries; steps++){
+		if(cluster / FAT_HASH_ENTRIES >= numBlocks || changedBlocks[cluster / FAT_HASH_ENTRIES]){
+	    	return true;
+		}
+		cluster = readFAT(cluster) & 0x0FFFFFFF;
+    }
+    return false;
+}
+
+// Follow the chain at cluster through the current FAT and otherFAT together and report
+// the first entry that differs. End of chain markers all count as the same
+bool chainsDiffer(unsigned long cluster, unsigned int *otherFAT, unsigned long otherEntries){
+    unsigned long steps, next, otherNext;
+
+    for(steps = 0; cluster >= 2 && cluster < 0x0FFFFFF7 && steps < numFATEntries; steps++){
+		if(cluster >= otherEntries){
+	    	return true;
+		}
+		next      = readFAT(cluster) & 0x0FFFFFFF;
+		otherNext = otherFAT[cluster] & 0x0FFFFFFF;
+		if(next != otherNext && (next < 0x0FFFFFF7 || otherNext < 0x0FFFFFF7)){
+	    	return true;
+		}
+		cluster = next;
+    }
+    return false;
+}
+
+// Compare the current image against a snapshot file or another image and print the
+// added, removed, modified and moved entries and the FAT blocks that changed.
+// Only the directories whose clusters hash differently from the old side are decoded.
+// Files are modified when their chain hash differs, or against another image when the
+// entries of their chain differ between the two FATs
+bool diffImage(char *otherName){
+    Snapshot      old, current;
+    Volume        thisVolume;
+    FILE          *in = fopen(otherName, "rb");
+    char          magic[8] = {0};
+    unsigned int  *otherFAT = NULL;
+    unsigned long otherEntries = 0;
+    bool          *changedBlocks, *addedMoved;
+    SnapEntry     **oldList, **newList, **removed, **added, **match;
+    SnapEntry     key;
+    SnapEntry     *keyPointer = &key;
+    unsigned long block, firstBlock = 0;
+    int           i, j, numRemoved = 0, numAdded = 0;
+    int           numModified = 0, numMoved = 0, numChanged = 0;
+    int           cmp;
+
+    if(in == NULL){
+		printf("Could not open %s: %s\n", otherName, strerror(errno));
+		return false;
+    }
+
+    if(fread(magic, 1, 8, in) == 8 && memcmp(magic, "F32SNAP", 7) == 0 && magic[7] != '2'){
+		// older snapshots have no chain hashes
+		fclose(in);
+		printf("%s is from an older version, take a new SNAPSHOT\n", otherName);
+		return false;
+    }else if(memcmp(magic, "F32SNAP2", 8) == 0){
+		bool loaded = loadSnapshot(&old, in);
+
+		fclose(in);
+		if(!loaded){
+	    	printf("%s is not a valid snapshot\n", otherName);
+	    	return false;
+		}
+		qsort(old.dirs, old.numDirs, sizeof(SnapDir), compareSnapDirs);
+    }else{
+		// another image, build its snapshot and then switch back to this one
+		fclose(in);
+		saveVolume(&thisVolume);
+		memset(&old, 0, sizeof(old));
+		if(openImage(otherName)){
+	    	buildSnapshot(&old, NULL);
+	    	fclose(fileptr);
+	    	// keep the other FAT to compare chains exactly
+	    	otherFAT     = fatTable;
+	    	otherEntries = numFATEntries;
+	    	if(dirCache != NULL){
+				for(i = 0; i < DIR_CACHE_SLOTS; i++){
+		    		free(dirCache[i].data);
+				}
+				free(dirCache);
+	    	}
+		}
+		useVolume(&thisVolume);
+		if(old.numDirs == 0){
+	    	freeSnapshot(&old);
+	    	free(otherFAT);
+	    	return false;
+		}
+    }
+
+    memset(&current, 0, sizeof(current));
+    buildSnapshot(&current, &old);
+
+    // FAT blocks, consecutive changed blocks are printed as one cluster range
+    changedBlocks = current.changedBlocks;
+    for(block = 0; block < current.numBlocks; block++){
+		if(changedBlocks[block] && (block == 0 || !changedBlocks[block - 1])){
+	    	firstBlock = block;
+		}
+		if(changedBlocks[block] && !changedBlocks[block + 1]){
+	    	printf("changed clusters %lu-%lu\n", firstBlock * FAT_HASH_ENTRIES,
+		           (block + 1) * FAT_HASH_ENTRIES - 1);
+	    	numChanged += block + 1 - firstBlock;
+		}
+    }
+
+    // walk both entry lists in path order
+    oldList = malloc((old.numEntries + 1) * sizeof(SnapEntry*));
+    newList = malloc((current.numEntries + 1) * sizeof(SnapEntry*));
+    removed = malloc((old.numEntries + 1) * sizeof(SnapEntry*));
+    added   = malloc((current.numEntries + 1) * sizeof(SnapEntry*));
+    for(i = 0; i < old.numEntries; i++){
+		oldList[i] = &old.entries[i];
+    }
+    for(i = 0; i < current.numEntries; i++){
+		newList[i] = &current.entries[i];
+    }
+    qsort(oldList, old.numEntries, sizeof(SnapEntry*), compareSnapPaths);
+    qsort(newList, current.numEntries, sizeof(SnapEntry*), compareSnapPaths);
+
+    for(i = 0, j = 0; i < old.numEntries || j < current.numEntries;){
+		if(i == old.numEntries){
+	    	cmp = 1;
+		}else if(j == current.numEntries){
+	    	cmp = -1;
+		}else{
+	    	cmp = strcmp(oldList[i]->path, newList[j]->path);
+		}
+
+		if(cmp < 0){
+	    	removed[numRemoved++] = oldList[i++];
+		}else if(cmp > 0){
+	    	added[numAdded++] = newList[j++];
+		}else{
+	    	SnapEntry *was = oldList[i++];
+	    	SnapEntry *now = newList[j++];
+	    	bool      chainDiffers = false;
+
+	    	if(!(now->attr & 0x10)){
+				chainDiffers = otherFAT != NULL ?
+				               chainsDiffer(now->cluster, otherFAT, otherEntries) :
+				               was->chainHash != now->chainHash;
+	    	}
+	    	if(was->size != now->size || was->cluster != now->cluster || was->attr != now->attr ||
+	       	   was->wrtDate != now->wrtDate || was->wrtTime != now->wrtTime || chainDiffers){
+				printf("modified %s\n", now->path);
+				numModified++;
+	    	}
+		}
+    }
+
+    // a removed and an added entry with the same first cluster and size were moved
+    qsort(added, numAdded, sizeof(SnapEntry*), compareSnapClusters);
+    addedMoved = calloc(numAdded + 1, sizeof(bool));
+    for(i = 0; i < numRemoved; i++){
+		key.cluster = removed[i]->cluster;
+		match       = key.cluster < 2 ? NULL :
+		              bsearch(&keyPointer, added, numAdded, sizeof(SnapEntry*), compareSnapClusters);
+		if(match != NULL && (*match)->size == removed[i]->size && !addedMoved[match - added]){
+	    	printf("moved %s -> %s\n", removed[i]->path, (*match)->path);
+	    	addedMoved[match - added] = true;
+	    	numMoved++;
+		}else{
+	    	printf("removed %s\n", removed[i]->path);
+		}
+    }
+    for(i = 0; i < numAdded; i++){
+		if(!addedMoved[i]){
+	    	printf("added %s\n", added[i]->path);
+		}
+    }
+
+    printf("\nSummary: %d added, %d removed, %d modified, %d moved, %d changed FAT blocks\n",
+	       numAdded - numMoved, numRemoved - numMoved, numModified, numMoved, numChanged);
+    printf("Decoded %d of %d directories\n", current.numDecoded, current.numDirs);
+
+    free(otherFAT);
+    free(addedMoved);
+    free(oldList);
+    free(newList);
+    free(removed);
+    free(added);
+    freeSnapshot(&old);
+    freeSnapshot(&current);
+    return true;
+}
+
+// SHA-256 from FIPS 180-4, used to name the chunks in the store
+static const unsigned int sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256Block(unsigned int state[8], const unsigned char block[64]){
+    unsigned int w[64];
+    unsigned int a, b, c, d, e, f, g, h, t1, t2;
+    int          i;
+
+    for(i = 0; i < 16; i++){
+		w[i] = (unsigned int)block[i * 4] << 24 | (unsigned int)block[i * 4 + 1] << 16 |
+		       (unsigned int)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for(i = 16; i < 64; i++){
+		w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for(i = 0; i < 64; i++){
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256(const unsigned char *data, size_t n, unsigned char digest[32]){
+    unsigned int       state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned char      last[128];
+    unsigned long long bits = (unsigned long long)n * 8;
+    size_t             done, rest, padded;
+    int                i;
+
+    for(done = 0; done + 64 <= n; done += 64){
+		sha256Block(state, data + done);
+    }
+
+    // the rest of the data, a 1 bit, zeros and the length in bits fill one or two blocks
+    rest   = n - done;
+    padded = rest < 56 ? 64 : 128;
+    memset(last, 0, sizeof(last));
+    memcpy(last, data + done, rest);
+    last[rest] = 0x80;
+    for(i = 0; i < 8; i++){
+		last[padded - 1 - i] = bits >> (i * 8);
+    }
+    sha256Block(state, last);
+    if(padded == 128){
+		sha256Block(state, last + 64);
+    }
+
+    for(i = 0; i < 32; i++){
+		digest[i] = state[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+// Put one chunk in the store as objects/<first 2 hex digits>/<other 62>, unless it is
+// already there. hex gets the chunk's SHA-256
+bool storeChunk(const char *storeDir, const unsigned char *data, size_t n, char hex[65],
+		        StoreStats *stats){
+    unsigned char digest[32];
+    char          objectPath[PATH_MAX];
+    char          tempPath[PATH_MAX + 32]; // objectPath and the ".<pid>.tmp" suffix
+    struct stat   info;
+    FILE          *out;
+    int           i;
+
+    sha256(data, n, digest);
+    for(i = 0; i < 32; i++){
+		snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    stats->numChunks++;
+
+    snprintf(objectPath, PATH_MAX, "%s/objects/%.2s/%s", storeDir, hex, hex + 2);
+    if(stat(objectPath, &info) == 0){
+		stats->skippedBytes += n;
+		return true;
+    }
+
+    // write to a temporary name first so a chunk is never seen half written
+    snprintf(tempPath, sizeof(tempPath), "%s/objects/%.2s", storeDir, hex);
+    makeDirs(tempPath);
+    snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", objectPath, (int)getpid());
+    out = fopen(tempPath, "wb");
+    if(out == NULL){
+		printf("Could not create %s: %s\n", tempPath, strerror(errno));
+		return false;
+    }
+    if(fwrite(data, 1, n, out) != n || fclose(out) != 0 || rename(tempPath, objectPath) != 0){
+		printf("Could not write %s: %s\n", objectPath, strerror(errno));
+		unlink(tempPath);
+		return false;
+    }
+    stats->newChunks++;
+    stats->newBytes += n;
+    return true;
+}
+
+// Cut the file at cluster into STORE_CHUNK_BYTES chunks, hash and store each one as it is
+// read and list the chunks in the manifest. chunk must hold STORE_CHUNK_BYTES
+bool storeFile(const char *storeDir, FILE *manifest, unsigned long cluster, unsigned long size,
+	           unsigned char *chunk, StoreStats *stats){
+    unsigned long bytesPerCluster = sectorsPerCluster * 512;
+    unsigned long chunkBytes      = STORE_CHUNK_BYTES;
+    unsigned long offset = 0, length, got, first, run, next, count;
+    char          hex[65];
+
+    // clusters bigger than a chunk are stored one cluster per chunk
+    if(chunkBytes < bytesPerCluster){
+		chunkBytes = bytesPerCluster;
+    }
+
+    while(offset < size){
+		length = size - offset < chunkBytes ? size - offset : chunkBytes;
+
+		// read the clusters of this chunk, runs of neighbouring clusters in one fread
+		for(got = 0; got < length; got += count){
+	    	if(cluster < 2 || cluster >= 0x0FFFFFF7){
+				printf("Cluster chain ends before the end of the file\n");
+				return false;
+	    	}
+	    	first = cluster;
+	    	run   = 1;
+	    	next  = readFAT(cluster) & 0x0FFFFFFF;
+	    	while(next == first + run && got + (run + 1) * bytesPerCluster <= length){
+				run++;
+				next = readFAT(next) & 0x0FFFFFFF;
+	    	}
+	    	count = run * bytesPerCluster < length - got ? run * bytesPerCluster : length - got;
+
+	    	fseek(fileptr, (getFirstSector(first) + fatLBA) * 512, SEEK_SET);
+	    	if(fread(chunk + got, count, 1, fileptr) != 1){
+				printf("Could not read cluster %lu\n", first);
+				return false;
+	    	}
+	    	cluster = next;
+		}
+
+		if(!storeChunk(storeDir, chunk, length, hex, stats)){
+	    	return false;
+		}
+		fprintf(manifest, "%s %lu\n", hex, length);
+		offset += length;
+    }
+    return true;
+}
+
+// Store every file passing the filters in the content-addressed store at storeDir and write
+// a manifest for each under manifestDir, keeping the directory tree. A manifest is
+//     FAT32 manifest 1
+//     size <bytes>
+//     written <last write time>
+//     <sha256> <length>      one line per chunk, in file order
+// and the file is the chunks from storeDir/objects put back together. A manifest is written
+// under a temporary name and only renamed once all its chunks are stored, files that fail
+// are reported and skipped
+bool storeAll(char *storeDir, char *manifestDir, char *filterArgs){
+    TarState       state;
+    StoreStats     stats;
+    ByteBuffer     written = {NULL, 0, 0, false};
+    unsigned char  *chunk;
+    unsigned long  bytesPerCluster = sectorsPerCluster * 512;
+    char           path[PATH_MAX];
+    char           tempPath[PATH_MAX + 32];
+    char           *slash;
+    FILE           *manifest;
+    bool           ok;
+    int            i, numFailed = 0;
+
+    memset(&state, 0, sizeof(state));
+    memset(&stats, 0, sizeof(stats));
+
+    state.useFilter = filterArgs[strspn(filterArgs, " ")] != '\0';
+    if(!parseFilter(filterArgs, &state.filter)){
+		return false;
+    }
+    snprintf(path, PATH_MAX, "%s/objects", storeDir);
+    if(!makeDirs(path) || !makeDirs(manifestDir)){
+		printf("Could not create %s: %s\n", path, strerror(errno));
+		freeFilter(&state.filter);
+		return false;
+    }
+
+    // files in first cluster order, so the image is read from start to end. The paths are
+    // made of safe names (see getSafeName), so manifests stay inside manifestDir
+    walkDir(bpb.BPB_RootClus, "", tarCallback, &state, true);
+    freeFilter(&state.filter);
+    qsort(state.items, state.numItems, sizeof(TarItem), compareTarItems);
+
+    chunk = malloc(STORE_CHUNK_BYTES > bytesPerCluster ? STORE_CHUNK_BYTES : bytesPerCluster);
+    for(i = 0; i < state.numItems; i++){
+		TarItem *item = &state.items[i];
+
+		snprintf(path, PATH_MAX, "%s/%s", manifestDir, item->path);
+		if(item->isDir){
+	    	makeDirs(path);
+	    	continue;
+		}
+		slash  = strrchr(path, '/');
+		*slash = '\0';
+		makeDirs(path);
+		*slash = '/';
+
+		snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", path, (int)getpid());
+		manifest = createFile(tempPath);
+		if(manifest == NULL){
+	    	printf("Could not create %s: %s\n", tempPath, strerror(errno));
+	    	numFailed++;
+	    	continue;
+		}
+		written.used = 0;
+		if(item->date != 0){
+	    	appendTimestamp(&written, item->date, item->time, -1, true);
+		}
+		appendBytes(&written, "", 1);
+		fprintf(manifest, "FAT32 manifest 1\nsize %lu\nwritten %s\n", item->size,
+		        item->date != 0 ? (char*)written.data : "-");
+
+		ok = storeFile(storeDir, manifest, item->cluster, item->size, chunk, &stats);
+		ok = fclose(manifest) == 0 && ok && rename(tempPath, path) == 0;
+		if(!ok){
+	    	// leave no manifest for a file that is not all in the store
+	    	printf("Could not store /%s\n", item->path);
+	    	unlink(tempPath);
+	    	numFailed++;
+	    	continue;
+		}
+		stats.numFiles++;
+    }
+
+    for(i = 0; i < state.numItems; i++){
+		free(state.items[i].path);
+    }
+    free(state.items);
+    free(chunk);
+    free(written.data);
+
+    printf("Stored %lu files in %lu chunks: %lu new chunks (%'lu bytes written), %'lu bytes already in the store\n",
+	       stats.numFiles, stats.numChunks, stats.newChunks, stats.newBytes, stats.skippedBytes);
+    if(numFailed > 0){
+		printf("%d files could not be stored\n", numFailed);
+    }
+    return numFailed == 0;
+}